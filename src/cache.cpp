@@ -0,0 +1,144 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "cache.h"
+#include <cstring>
+
+
+PredictionCache::PredictionCache()
+: m_capacity(0), m_inputs(0), m_outputs(0), m_mask(0), m_generation(1), m_used(0), m_hand(0), m_version(0), m_hits(0), m_misses(0)
+{
+}
+
+void PredictionCache::resize(size_t capacity, size_t inputs, size_t outputs)
+{
+	m_capacity = capacity;
+	m_inputs = inputs;
+	m_outputs = outputs;
+	m_keys.resize(capacity * inputs);
+	m_values.resize(capacity * outputs);
+	m_hashes.resize(capacity);
+	m_referenced.resize(capacity);
+
+	// At least twice as many buckets as entries keeps the probe sequences short
+	size_t buckets = 1;
+	while(buckets < 2 * capacity)
+		buckets *= 2;
+	Bucket empty = {0, 0};
+	m_buckets.assign(buckets, empty);
+	m_mask = buckets - 1;
+	m_generation = 1;
+	clear();
+}
+
+void PredictionCache::clear()
+{
+	m_generation++;
+	m_used = 0;
+	m_hand = 0;
+}
+
+// static
+uint64_t PredictionCache::hash(const double* in, size_t count)
+{
+	uint64_t h = count;
+	for(size_t i = 0; i < count; i++)
+	{
+		uint64_t bits;
+		memcpy(&bits, &in[i], sizeof(bits));
+		h = (h ^ bits) * 0x100000001B3ull;
+	}
+
+	// Finish with the SplitMix64 finalizer, so the low bits depend on every input bit
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+	return h ^ (h >> 31);
+}
+
+size_t PredictionCache::locate(uint64_t h) const
+{
+	// Returns the bucket that holds h, or the empty bucket where it would go
+	size_t b = h & m_mask;
+	while(occupied(b) && m_hashes[m_buckets[b].slot] != h)
+		b = (b + 1) & m_mask;
+	return b;
+}
+
+void PredictionCache::erase(size_t bucket)
+{
+	// Shift later members of the probe sequence back, so no tombstones are needed
+	size_t hole = bucket;
+	for(size_t b = (hole + 1) & m_mask; occupied(b); b = (b + 1) & m_mask)
+	{
+		size_t home = m_hashes[m_buckets[b].slot] & m_mask;
+		if(((b - home) & m_mask) >= ((b - hole) & m_mask))
+		{
+			m_buckets[hole] = m_buckets[b];
+			hole = b;
+		}
+	}
+	m_buckets[hole].generation = 0;
+}
+
+const double* PredictionCache::find(const double* in, uint64_t version)
+{
+	if(m_capacity == 0)
+		return NULL;
+	if(version != m_version)
+	{
+		clear();
+		m_version = version;
+	}
+	size_t b = locate(hash(in, m_inputs));
+	if(!occupied(b) || memcmp(&m_keys[m_buckets[b].slot * m_inputs], in, m_inputs * sizeof(double)) != 0)
+	{
+		m_misses++;
+		return NULL;
+	}
+	m_hits++;
+	size_t slot = m_buckets[b].slot;
+	m_referenced[slot] = 1;
+	return &m_values[slot * m_outputs];
+}
+
+void PredictionCache::insert(const double* in, const double* out, uint64_t version)
+{
+	if(m_capacity == 0)
+		return;
+	if(version != m_version)
+	{
+		clear();
+		m_version = version;
+	}
+	uint64_t h = hash(in, m_inputs);
+	size_t b = locate(h);
+	size_t slot;
+	if(occupied(b))
+		slot = m_buckets[b].slot; // a different input with the same hash, or a repeat
+	else
+	{
+		if(m_used < m_capacity)
+			slot = m_used++;
+		else
+		{
+			// Sweep past recently used entries, giving each a second chance
+			while(m_referenced[m_hand])
+			{
+				m_referenced[m_hand] = 0;
+				m_hand = (m_hand + 1) % m_capacity;
+			}
+			slot = m_hand;
+			m_hand = (m_hand + 1) % m_capacity;
+			erase(locate(m_hashes[slot]));
+			b = locate(h); // (erasing may have moved the empty bucket)
+		}
+		m_buckets[b].generation = m_generation;
+		m_buckets[b].slot = slot;
+		m_hashes[slot] = h;
+	}
+	memcpy(&m_keys[slot * m_inputs], in, m_inputs * sizeof(double));
+	memcpy(&m_values[slot * m_outputs], out, m_outputs * sizeof(double));
+	m_referenced[slot] = 0;
+}
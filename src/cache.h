@@ -0,0 +1,78 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// A bounded cache of recent predictions, keyed on the exact bytes of the
+/// input vector. Entries are evicted with the CLOCK algorithm (an
+/// approximation of LRU that only sets a bit on a hit). Each entry remembers
+/// the model version it was computed with, and the whole cache is emptied the
+/// first time it sees a different version. Everything is allocated by resize,
+/// so finding, inserting and evicting entries never allocate.
+class PredictionCache
+{
+protected:
+	struct Bucket
+	{
+		uint64_t generation; // the bucket is empty unless this is m_generation
+		size_t slot;
+	};
+
+	size_t m_capacity;
+	size_t m_inputs;
+	size_t m_outputs;
+	std::vector<double> m_keys; // m_capacity rows of m_inputs values
+	std::vector<double> m_values; // m_capacity rows of m_outputs values
+	std::vector<uint64_t> m_hashes;
+	std::vector<unsigned char> m_referenced; // the CLOCK bits
+	std::vector<Bucket> m_buckets; // hash -> slot, open-addressed with linear probing, at most half full
+	size_t m_mask; // m_buckets.size() - 1 (the size is a power of 2)
+	uint64_t m_generation; // clear empties every bucket at once by bumping this
+	size_t m_used; // slots filled so far
+	size_t m_hand; // the next slot CLOCK considers evicting
+	uint64_t m_version;
+	uint64_t m_hits;
+	uint64_t m_misses;
+
+public:
+	PredictionCache();
+
+	/// Sets the number of entries (0 disables the cache) and the shape of the
+	/// vectors it stores. This empties the cache.
+	void resize(size_t capacity, size_t inputs, size_t outputs);
+
+	/// Returns the number of entries this cache can hold
+	size_t capacity() const { return m_capacity; }
+
+	/// Returns the cached prediction for in, or NULL if there is none that
+	/// was computed with the given model version
+	const double* find(const double* in, uint64_t version);
+
+	/// Remembers that the model with the given version predicted out for in
+	void insert(const double* in, const double* out, uint64_t version);
+
+	/// Drops every entry (but keeps the counters)
+	void clear();
+
+	uint64_t hits() const { return m_hits; }
+	uint64_t misses() const { return m_misses; }
+
+	/// Hashes the bytes of a vector of doubles
+	static uint64_t hash(const double* in, size_t count);
+
+protected:
+	bool occupied(size_t bucket) const { return m_buckets[bucket].generation == m_generation; }
+	size_t locate(uint64_t h) const;
+	void erase(size_t bucket);
+};
+
+
+#endif // CACHE_H
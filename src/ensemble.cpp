@@ -0,0 +1,177 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "ensemble.h"
+#include "neuralnet.h"
+#include "error.h"
+#include "string.h"
+#include <algorithm>
+
+using std::vector;
+
+
+Ensemble::Ensemble()
+: m_models(0)
+{
+}
+
+void Ensemble::clear()
+{
+	m_sizes.clear();
+	m_models = 0;
+	m_weights.clear();
+	m_bias.clear();
+	m_input_shift.clear();
+	m_input_scale.clear();
+	m_normalized.clear();
+}
+
+void Ensemble::add(const NeuralNet& nn)
+{
+	if(nn.m_layers.size() == 0)
+		throw Ex("Expected a network with at least one layer");
+	vector<size_t> sizes;
+	sizes.push_back(nn.m_layers[0]->inputs());
+	for(size_t i = 0; i < nn.m_layers.size(); i++)
+		sizes.push_back(nn.m_layers[i]->outputs());
+	if(m_models == 0)
+	{
+		m_sizes = sizes;
+		m_weights.resize(nn.m_layers.size());
+		m_bias.resize(nn.m_layers.size());
+	}
+	else if(sizes != m_sizes)
+		throw Ex("Every model in an ensemble must have the same topology");
+
+	// Re-interleave every array with one more lane
+	size_t oldModels = m_models;
+	size_t models = m_models + 1;
+	for(size_t l = 0; l < m_weights.size(); l++)
+	{
+		Layer* pLayer = nn.m_layers[l]->clone();
+		pLayer->densify();
+		size_t ins = m_sizes[l];
+		size_t outs = m_sizes[l + 1];
+		vector<double> weights(outs * ins * models);
+		vector<double> bias(outs * models);
+		for(size_t i = 0; i < outs; i++)
+		{
+			for(size_t j = 0; j < ins; j++)
+			{
+				double* pLanes = &weights[(i * ins + j) * models];
+				for(size_t m = 0; m < oldModels; m++)
+					pLanes[m] = m_weights[l][(i * ins + j) * oldModels + m];
+				pLanes[oldModels] = pLayer->m_weights[i][j];
+			}
+			for(size_t m = 0; m < oldModels; m++)
+				bias[i * models + m] = m_bias[l][i * oldModels + m];
+			bias[i * models + oldModels] = pLayer->m_bias[i];
+		}
+		m_weights[l].swap(weights);
+		m_bias[l].swap(bias);
+		delete(pLayer);
+	}
+
+	size_t ins = m_sizes[0];
+	bool normalized = nn.m_input_shift.size() > 0;
+	vector<double> shift(ins * models);
+	vector<double> scale(ins * models);
+	for(size_t j = 0; j < ins; j++)
+	{
+		for(size_t m = 0; m < oldModels; m++)
+		{
+			shift[j * models + m] = m_input_shift[j * oldModels + m];
+			scale[j * models + m] = m_input_scale[j * oldModels + m];
+		}
+		shift[j * models + oldModels] = normalized ? nn.m_input_shift[j] : 0.0;
+		scale[j * models + oldModels] = normalized ? nn.m_input_scale[j] : 1.0;
+	}
+	m_input_shift.swap(shift);
+	m_input_scale.swap(scale);
+	m_normalized.push_back(normalized ? 1 : 0);
+	m_models = models;
+
+	size_t widest = 0;
+	for(size_t i = 0; i < m_sizes.size(); i++)
+		widest = std::max(widest, m_sizes[i]);
+	m_buf[0].resize(widest * models);
+	m_buf[1].resize(widest * models);
+	m_output.resize(outputs() * models);
+}
+
+const vector<double>& Ensemble::predict(const double* in)
+{
+	if(m_models == 0)
+		throw Ex("The ensemble is empty");
+	size_t models = m_models;
+
+	// Broadcast the input to every lane, normalizing it for the models that
+	// normalize (with the same arithmetic as NeuralNet::normalize)
+	double* pIn = m_buf[0].data();
+	for(size_t j = 0; j < m_sizes[0]; j++)
+	{
+		const double* pShift = &m_input_shift[j * models];
+		const double* pScale = &m_input_scale[j * models];
+		for(size_t m = 0; m < models; m++)
+		{
+			double x = in[j];
+			if(m_normalized[m])
+				x = in[j] == UNKNOWN_VALUE ? 0.0 : (in[j] - pShift[m]) * pScale[m];
+			pIn[j * models + m] = x;
+		}
+	}
+
+	for(size_t l = 0; l < m_weights.size(); l++)
+	{
+		size_t ins = m_sizes[l];
+		size_t outs = m_sizes[l + 1];
+		double* pOut = l + 1 == m_weights.size() ? m_output.data() : m_buf[(l + 1) % 2].data();
+		const double* pWeights = m_weights[l].data();
+		const double* pBias = m_bias[l].data();
+		for(size_t i = 0; i < outs; i++)
+		{
+			// Each lane accumulates one model's dot product, in input order.
+			// Blocks of four lanes keep their sums in SIMD registers.
+			const double* pRow = &pWeights[i * ins * models];
+			double* pSum = &pOut[i * models];
+			size_t m = 0;
+			for(; m + ENSEMBLE_LANES <= models; m += ENSEMBLE_LANES)
+			{
+				double s[ENSEMBLE_LANES] = { 0.0, 0.0, 0.0, 0.0 };
+				for(size_t j = 0; j < ins; j++)
+				{
+					const double* pX = &pIn[j * models + m];
+					const double* pW = &pRow[j * models + m];
+					for(size_t k = 0; k < ENSEMBLE_LANES; k++)
+						s[k] += pX[k] * pW[k];
+				}
+				for(size_t k = 0; k < ENSEMBLE_LANES; k++)
+					pSum[m + k] = s[k];
+			}
+			for(; m < models; m++)
+			{
+				double s = 0.0;
+				for(size_t j = 0; j < ins; j++)
+					s += pIn[j * models + m] * pRow[j * models + m];
+				pSum[m] = s;
+			}
+			for(m = 0; m < models; m++)
+				pSum[m] = activation(pSum[m] + pBias[i * models + m]);
+		}
+		pIn = pOut;
+	}
+	return m_output;
+}
+
+void Ensemble::mean(const vector<double>& predictions, double* out) const
+{
+	for(size_t i = 0; i < outputs(); i++)
+	{
+		double sum = 0.0;
+		for(size_t m = 0; m < m_models; m++)
+			sum += predictions[i * m_models + m];
+		out[i] = sum / m_models;
+	}
+}
@@ -0,0 +1,62 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <vector>
+#include <stddef.h>
+
+class NeuralNet;
+
+/// The number of models Ensemble::predict evaluates together
+#define ENSEMBLE_LANES 4
+
+
+/// Evaluates many networks with the same topology in one pass. The weights
+/// are interleaved so that the model index is the innermost dimension, which
+/// turns the per-model dot products into one loop over contiguous lanes that
+/// the compiler can vectorize. Each model still sums its products in the
+/// same order as NeuralNet, so the predictions are bit-identical.
+class Ensemble
+{
+protected:
+	std::vector<size_t> m_sizes; // the number of units in each layer, starting with the inputs
+	size_t m_models;
+	std::vector< std::vector<double> > m_weights; // per layer: [output][input][model]
+	std::vector< std::vector<double> > m_bias; // per layer: [output][model]
+	std::vector<double> m_input_shift; // [input][model] (0 for models that do not normalize)
+	std::vector<double> m_input_scale; // [input][model] (1 for models that do not normalize)
+	std::vector<unsigned char> m_normalized; // per model
+	std::vector<double> m_buf[2]; // ping-pong activations, [unit][model]
+	std::vector<double> m_output; // [output][model]
+
+public:
+	Ensemble();
+
+	/// Returns the number of models
+	size_t size() const { return m_models; }
+
+	size_t inputs() const { return m_sizes.size() > 0 ? m_sizes[0] : 0; }
+	size_t outputs() const { return m_sizes.size() > 0 ? m_sizes[m_sizes.size() - 1] : 0; }
+
+	/// Copies the weights of nn into a new lane. Every model must have the
+	/// same topology as the first one.
+	void add(const NeuralNet& nn);
+
+	/// Removes every model
+	void clear();
+
+	/// Evaluates every model. The result has outputs() rows of size() values,
+	/// so model m's prediction for output i is at [i * size() + m]. (It stays
+	/// valid until the next call.)
+	const std::vector<double>& predict(const double* in);
+
+	/// Averages a result of predict over the models
+	void mean(const std::vector<double>& predictions, double* out) const;
+};
+
+
+#endif // ENSEMBLE_H
@@ -0,0 +1,17 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "fixednet.h"
+
+
+// FixedNet lives entirely in its header, and nothing in the extension uses
+// it, so these instantiations are what make every build compile all of its
+// members. (tests/NativeTest.cpp checks that it predicts like NeuralNet.)
+template class FixedNet<3, 16, 2>;
+template class FixedNet<4, 8, 8, 1>;
+
+static_assert(FixedNet<3, 16, 2>::inputs == 3 && FixedNet<3, 16, 2>::outputs == 2, "FixedNet<3, 16, 2> should have 3 inputs and 2 outputs");
+static_assert(FixedNet<3, 16, 2>::layerCount == 2, "FixedNet<3, 16, 2> should have 2 layers");
+static_assert(FixedNet<4, 8, 8, 1>::layerCount == 3, "FixedNet<4, 8, 8, 1> should have 3 layers");
@@ -0,0 +1,192 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef FIXEDNET_H
+#define FIXEDNET_H
+
+#include <array>
+#include <string>
+#include <algorithm>
+#include "neuralnet.h"
+#include "rand.h"
+#include "error.h"
+#include "string.h"
+
+
+/// One layer of a FixedNet. The weights are stored row-major, one row per
+/// output, so every loop bound is a compile-time constant.
+template<size_t In, size_t Out>
+struct FixedLayer
+{
+	std::array<double, In * Out> m_weights;
+	std::array<double, Out> m_bias;
+
+	/// Computes the activations for in. (The same sums as Layer::compute, in
+	/// the same order, so the results are identical.)
+	void compute(const double* in, double* out) const
+	{
+		for(size_t i = 0; i < Out; i++)
+		{
+			const double* w = &m_weights[i * In];
+			double d = 0.0;
+			for(size_t j = 0; j < In; j++)
+				d += in[j] * w[j];
+			out[i] = activation(d + m_bias[i]);
+		}
+	}
+
+	/// Copies the weights of a dynamic layer with the same shape
+	void load(const Layer& layer)
+	{
+		if(layer.inputs() != In || layer.outputs() != Out)
+			throw Ex("Expected a layer with ", to_str(In), " inputs and ", to_str(Out), " outputs");
+		Layer* pDense = layer.clone();
+		pDense->densify();
+		for(size_t i = 0; i < Out; i++)
+		{
+			std::copy(pDense->m_weights[i].begin(), pDense->m_weights[i].end(), m_weights.begin() + i * In);
+			m_bias[i] = pDense->m_bias[i];
+		}
+		delete(pDense);
+	}
+};
+
+
+/// A chain of FixedLayers, one for each adjacent pair of sizes
+template<size_t In, size_t Out, size_t... Rest>
+struct FixedLayers
+{
+	static const size_t layerCount = 1 + FixedLayers<Out, Rest...>::layerCount;
+	static const size_t outputs = FixedLayers<Out, Rest...>::outputs;
+
+	FixedLayer<In, Out> m_layer;
+	FixedLayers<Out, Rest...> m_next;
+
+	void predict(const double* in, double* out) const
+	{
+		std::array<double, Out> activations;
+		m_layer.compute(in, activations.data());
+		m_next.predict(activations.data(), out);
+	}
+
+	void load(const std::vector<Layer*>& layers, size_t first)
+	{
+		m_layer.load(*layers[first]);
+		m_next.load(layers, first + 1);
+	}
+};
+
+template<size_t In, size_t Out>
+struct FixedLayers<In, Out>
+{
+	static const size_t layerCount = 1;
+	static const size_t outputs = Out;
+
+	FixedLayer<In, Out> m_layer;
+
+	void predict(const double* in, double* out) const
+	{
+		m_layer.compute(in, out);
+	}
+
+	void load(const std::vector<Layer*>& layers, size_t first)
+	{
+		m_layer.load(*layers[first]);
+	}
+};
+
+
+/// A NeuralNet whose topology is fixed at compile time, for small models
+/// where vector bookkeeping and Layer indirection cost more than the math.
+/// FixedNet<3, 16, 2> has 3 inputs, 16 hidden units and 2 outputs. It only
+/// predicts: train a NeuralNet, then load its weights into one of these. The
+/// predictions are bit-identical to NeuralNet::predict.
+template<size_t... Ns>
+class FixedNet
+{
+protected:
+	template<size_t First, size_t...>
+	struct FirstOf
+	{
+		static const size_t value = First;
+	};
+
+public:
+	static const size_t inputs = FirstOf<Ns...>::value;
+	static const size_t outputs = FixedLayers<Ns...>::outputs;
+	static const size_t layerCount = FixedLayers<Ns...>::layerCount;
+
+	typedef std::array<double, inputs> Input;
+	typedef std::array<double, outputs> Output;
+
+protected:
+	FixedLayers<Ns...> m_layers;
+	std::array<double, inputs> m_input_shift;
+	std::array<double, inputs> m_input_scale;
+	bool m_normalized;
+
+public:
+	FixedNet() : m_normalized(false)
+	{
+		m_input_shift.fill(0.0);
+		m_input_scale.fill(1.0);
+	}
+
+	/// Copies the weights and input normalization of nn, which must have the same topology
+	void load(const NeuralNet& nn)
+	{
+		if(nn.m_layers.size() != layerCount)
+			throw Ex("Expected ", to_str(layerCount), " layers, got ", to_str(nn.m_layers.size()));
+		m_layers.load(nn.m_layers, 0);
+		m_normalized = nn.m_input_shift.size() > 0;
+		for(size_t i = 0; i < inputs; i++)
+		{
+			m_input_shift[i] = m_normalized ? nn.m_input_shift[i] : 0.0;
+			m_input_scale[i] = m_normalized ? nn.m_input_scale[i] : 1.0;
+		}
+	}
+
+	/// Loads a model file that was written by NeuralNet::save
+	void load(std::string filename)
+	{
+		Rand r(0);
+		NeuralNet nn(r);
+		nn.load(filename);
+		load(nn);
+	}
+
+	/// Computes the outputs for in
+	void predict(const double* in, double* out) const
+	{
+		if(m_normalized)
+		{
+			// The same arithmetic as NeuralNet::normalize
+			Input normalized;
+			for(size_t i = 0; i < inputs; i++)
+			{
+				double x = (in[i] - m_input_shift[i]) * m_input_scale[i];
+				normalized[i] = in[i] == UNKNOWN_VALUE ? 0.0 : x;
+			}
+			m_layers.predict(normalized.data(), out);
+		}
+		else
+			m_layers.predict(in, out);
+	}
+
+	Output predict(const Input& in) const
+	{
+		Output out;
+		predict(in.data(), out.data());
+		return out;
+	}
+};
+
+// (C++11 needs these definitions when the constants are bound to references)
+template<size_t... Ns> const size_t FixedNet<Ns...>::inputs;
+template<size_t... Ns> const size_t FixedNet<Ns...>::outputs;
+template<size_t... Ns> const size_t FixedNet<Ns...>::layerCount;
+
+
+#endif // FIXEDNET_H
@@ -9,11 +9,19 @@
 #include <memory>
 #include <vector>
 #include <cmath>
+#include <algorithm>
 #include "error.h"
 #include "string.h"
 #include "rand.h"
 #include "matrix.h"
 #include "neuralnet.h"
+#include "trainer.h"
+#include "cache.h"
+#include "ensemble.h"
+#include "paramserver.h"
+#include "pipeline.h"
+#include "threadpool.h"
+#include "search.h"
 
 using std::vector;
 
@@ -23,6 +31,81 @@ class NeuralNetwork : public Php::Base
         Rand rand;
         NeuralNet nn;
         size_t inputCount = 0;
+        SparseVector sparse;
+        std::unique_ptr<BackgroundTrainer> trainer;
+        InferenceContext context;
+        PredictionCache cache;
+        size_t outputCount = 0;
+        vector<double> input; // reused by predict, so it never allocates
+
+        // Reads an array of (input index => value) pairs
+        void readSparse(const Php::Value &input)
+        {
+            sparse.clear();
+            for (auto &iter : input)
+            {
+                int64_t index = iter.first.numericValue();
+                if (index < 0 || (size_t) index >= inputCount)
+                {
+                    throw Php::Exception("Sparse input index out of range.");
+                }
+
+                double value = iter.second.floatValue();
+                if (value != 0.0)
+                {
+                    sparse.add((size_t) index, value);
+                }
+            }
+        }
+
+        // Reads an array of arrays with cols values each
+        static void readMatrix(const Php::Value &rows, Matrix &m, size_t cols)
+        {
+            m.setSize(rows.size(), cols);
+            size_t i = 0;
+            for (auto &row : rows)
+            {
+                if (row.second.size() != (int) cols)
+                {
+                    throw Php::Exception("Every row must have " + std::to_string(cols) + " values.");
+                }
+                for (size_t j = 0; j < cols; j++)
+                {
+                    m[i][j] = row.second.get((int) j).floatValue();
+                }
+                i++;
+            }
+        }
+
+        // Sizes the shared pool from the ini settings. This runs whenever a
+        // network is made, not at startup, so ini_set (or the <ini> entries
+        // of phpunit.xml) can still change them until the pool first starts.
+        static void configurePool()
+        {
+            int64_t threads = Php::ini_get("neuralnetwork.threads");
+            std::string pinning = Php::ini_get("neuralnetwork.pinning");
+            PinPolicy pin = PIN_NONE;
+            if (pinning == "compact")
+            {
+                pin = PIN_COMPACT;
+            }
+            else if (pinning == "scatter")
+            {
+                pin = PIN_SCATTER;
+            }
+            ThreadPool::configure((size_t) std::max((int64_t) 0, threads), pin);
+        }
+
+        // Reads settings[key] as an integer of at least min, or returns fallback
+        static size_t readOption(const Php::Value &settings, const char *key, size_t fallback, int64_t min)
+        {
+            if (!settings.contains(key))
+            {
+                return fallback;
+            }
+
+            return (size_t) std::max(min, settings.get(key).numericValue());
+        }
 
     public:
         NeuralNetwork() : rand(0), nn(rand) {}
@@ -31,6 +114,24 @@ class NeuralNetwork : public Php::Base
 
         void __construct(Php::Parameters &params)
         {
+            configurePool();
+
+            // An optional trailing array holds settings
+            int64_t cacheSize = Php::ini_get("neuralnetwork.prediction_cache");
+            if (params.size() > 0 && params.back().isArray())
+            {
+                Php::Value options = params.back();
+                params.pop_back();
+                if (options.contains("prediction_cache"))
+                {
+                    cacheSize = options.get("prediction_cache").numericValue();
+                }
+            }
+            if (cacheSize < 0)
+            {
+                throw Php::Exception("The prediction cache size cannot be negative.");
+            }
+
             if (params.size() < 3)
             {
                 Php::error << "Neural Network requires inputs, at least one hidden layer, and outputs." << std::flush;
@@ -56,34 +157,624 @@ class NeuralNetwork : public Php::Base
             }
 
             nn.init();
+            outputCount = (size_t) outputs;
+            input.resize(inputCount);
+            cache.resize((size_t) cacheSize, inputCount, outputCount);
+        }
+
+        // Methods that change the network directly cannot be mixed with background training
+        void checkForeground()
+        {
+            if (trainer)
+            {
+                throw Php::Exception("Not available during background training. Call stopBackgroundTraining() first.");
+            }
+        }
+
+        // The network itself, for other classes of this extension
+        const NeuralNet& network()
+        {
+            checkForeground();
+            return nn;
+        }
+
+        void checkTrainable()
+        {
+            if (nn.isFrozen())
+            {
+                throw Php::Exception("This network is frozen. Call thaw() before refining it.");
+            }
+        }
+
+        // Checks that a pattern has a value for each input (unless it is sparse) and each output
+        void checkPattern(const Php::Value &feature, const Php::Value &label, bool sparse = false)
+        {
+            if ((!sparse && feature.size() != (int) inputCount) || label.size() != (int) outputCount)
+            {
+                throw Php::Exception("Patterns must have " + std::to_string(inputCount) + " inputs and " + std::to_string(outputCount) + " outputs.");
+            }
         }
 
         void refine(Php::Parameters &params)
         {
+            checkTrainable();
+            checkPattern(params[0], params[1]);
+            if (trainer)
+            {
+                enqueue(params);
+                return;
+            }
+
             nn.refine(params[0], params[1], params[2]);
         }
 
-        Php::Value predict(Php::Parameters &params)
+        bool enqueue(Php::Parameters &params)
+        {
+            TrainingSample sample;
+            sample.feature = params[0].vectorValue<double>();
+            sample.label = params[1].vectorValue<double>();
+            sample.learning_rate = params[2];
+
+            return trainer->enqueue(sample);
+        }
+
+        Php::Value enqueueRefine(Php::Parameters &params)
+        {
+            checkTrainable();
+            checkPattern(params[0], params[1]);
+            if (!trainer)
+            {
+                trainer.reset(new BackgroundTrainer(nn));
+            }
+
+            return enqueue(params);
+        }
+
+        Php::Value trainProcesses(Php::Parameters &params)
+        {
+            checkForeground();
+            checkTrainable();
+            if (params[0].size() != params[1].size())
+            {
+                throw Php::Exception("There must be one label row for each feature row.");
+            }
+
+            Matrix features, labels;
+            readMatrix(params[0], features, inputCount);
+            readMatrix(params[1], labels, outputCount);
+
+            ProcessTrainerOptions options;
+            if (params.size() > 2)
+            {
+                Php::Value settings = params[2];
+                options.workers = readOption(settings, "workers", options.workers, 1);
+                options.epochs = readOption(settings, "epochs", options.epochs, 0);
+                options.batch_size = readOption(settings, "batch_size", options.batch_size, 1);
+                options.staleness = readOption(settings, "staleness", options.staleness, 0);
+                if (settings.contains("learning_rate"))
+                {
+                    options.learning_rate = settings.get("learning_rate").floatValue();
+                }
+            }
+
+            try
+            {
+                ProcessTrainer processTrainer(options);
+                return (int64_t) processTrainer.train(nn, features, labels);
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+        }
+
+        void trainPipeline(Php::Parameters &params)
+        {
+            checkForeground();
+            checkTrainable();
+            if (params[0].size() != params[1].size())
+            {
+                throw Php::Exception("There must be one label row for each feature row.");
+            }
+
+            Matrix features, labels;
+            readMatrix(params[0], features, inputCount);
+            readMatrix(params[1], labels, outputCount);
+
+            PipelineOptions options;
+            if (params.size() > 2)
+            {
+                Php::Value settings = params[2];
+                options.stages = readOption(settings, "stages", options.stages, 1);
+                options.micro_batches = readOption(settings, "micro_batches", options.micro_batches, 1);
+                options.micro_batch_rows = readOption(settings, "micro_batch_rows", options.micro_batch_rows, 1);
+                options.epochs = readOption(settings, "epochs", options.epochs, 0);
+                if (settings.contains("learning_rate"))
+                {
+                    options.learning_rate = settings.get("learning_rate").floatValue();
+                }
+            }
+
+            try
+            {
+                PipelineTrainer pipelineTrainer(nn, options);
+                pipelineTrainer.train(features, labels);
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+        }
+
+        Php::Value evaluate(Php::Parameters &params)
+        {
+            if (params[0].size() != params[1].size())
+            {
+                throw Php::Exception("There must be one label row for each feature row.");
+            }
+
+            Matrix features, labels;
+            readMatrix(params[0], features, inputCount);
+            readMatrix(params[1], labels, outputCount);
+
+            Evaluation result;
+            try
+            {
+                // Like predict, this reads the published snapshot during background training
+                result = trainer ? trainer->evaluate(features, labels) : nn.evaluate(features, labels);
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+
+            Php::Array array;
+            array["sse"] = result.sse;
+            array["rmse"] = result.rmse;
+            array["mae"] = result.mae;
+            array["accuracy"] = result.accuracy;
+
+            return array;
+        }
+
+        Php::Value search(Php::Parameters &params)
+        {
+            if (params[0].size() != params[1].size())
+            {
+                throw Php::Exception("There must be one label row for each feature row.");
+            }
+
+            Matrix features, labels;
+            readMatrix(params[0], features, inputCount);
+            readMatrix(params[1], labels, outputCount);
+
+            SearchSpace space;
+            Php::Value spec = params[2];
+            if (spec.contains("topologies"))
+            {
+                for (auto &topology : spec.get("topologies"))
+                {
+                    std::vector<size_t> widths;
+                    for (auto &width : topology.second)
+                    {
+                        widths.push_back((size_t) std::max((int64_t) 0, width.second.numericValue()));
+                    }
+                    space.topologies.push_back(widths);
+                }
+            }
+            if (spec.contains("learning_rates"))
+            {
+                for (auto &rate : spec.get("learning_rates"))
+                {
+                    space.learning_rates.push_back(rate.second.floatValue());
+                }
+            }
+            space.samples = readOption(spec, "samples", 0, 0);
+
+            SearchOptions options;
+            if (params.size() > 3)
+            {
+                Php::Value settings = params[3];
+                options.folds = readOption(settings, "folds", options.folds, 0);
+                options.epochs = readOption(settings, "epochs", options.epochs, 1);
+                options.min_epochs = readOption(settings, "min_epochs", options.min_epochs, 1);
+                options.reduction = readOption(settings, "reduction", options.reduction, 2);
+                options.seed = readOption(settings, "seed", options.seed, 0);
+            }
+
+            std::vector<SearchResult> results;
+            try
+            {
+                ModelSearch search(features, labels, space, options);
+                results = search.run();
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+
+            Php::Array table;
+            for (size_t i = 0; i < results.size(); i++)
+            {
+                Php::Array hidden;
+                for (size_t j = 0; j < results[i].hidden.size(); j++)
+                {
+                    hidden[(int) j] = (int64_t) results[i].hidden[j];
+                }
+
+                Php::Array row;
+                row["hidden"] = hidden;
+                row["learning_rate"] = results[i].learning_rate;
+                row["epochs"] = (int64_t) results[i].epochs;
+                row["rmse"] = results[i].rmse;
+                row["rmse_deviation"] = results[i].rmse_deviation;
+                table[(int) i] = row;
+            }
+
+            return table;
+        }
+
+        void setMixedPrecision(Php::Parameters &params)
+        {
+            checkForeground();
+            nn.setMixedPrecision(params[0].boolValue());
+        }
+
+        void setParallelForward(Php::Parameters &params)
+        {
+            checkForeground();
+            int64_t minWeights = params.size() > 1 ? (int64_t) params[1] : 65536;
+            if (minWeights < 0)
+            {
+                throw Php::Exception("The weight threshold cannot be negative.");
+            }
+
+            // Every network shares the process-wide pool
+            nn.setThreadPool(params[0].boolValue() ? &ThreadPool::shared() : NULL, (size_t) minWeights);
+        }
+
+        void freeze()
+        {
+            checkForeground();
+            nn.freeze();
+        }
+
+        void thaw()
+        {
+            checkForeground();
+            nn.thaw();
+        }
+
+        void startBackgroundTraining(Php::Parameters &params)
+        {
+            checkForeground();
+            checkTrainable();
+
+            int64_t publishEvery = params.size() > 0 ? (int64_t) params[0] : 256;
+            if (publishEvery < 1)
+            {
+                throw Php::Exception("Snapshots must be published at least every 1 pattern.");
+            }
+
+            int64_t capacity = params.size() > 1 ? (int64_t) params[1] : 4096;
+            if (capacity < 1)
+            {
+                throw Php::Exception("The training queue must hold at least 1 pattern.");
+            }
+
+            int64_t policy = params.size() > 2 ? (int64_t) params[2] : (int64_t) QUEUE_BLOCK;
+            if (policy < QUEUE_BLOCK || policy > QUEUE_DROP_OLDEST)
+            {
+                throw Php::Exception("Unknown queue policy.");
+            }
+
+            int64_t batchSize = params.size() > 3 ? (int64_t) params[3] : 32;
+            if (batchSize < 1)
+            {
+                throw Php::Exception("Mini-batches must hold at least 1 pattern.");
+            }
+
+            TrainerOptions options;
+            options.publish_every = (size_t) publishEvery;
+            options.capacity = (size_t) capacity;
+            options.policy = (QueuePolicy) policy;
+            options.batch_size = (size_t) batchSize;
+            trainer.reset(new BackgroundTrainer(nn, options));
+        }
+
+        void flushTraining()
+        {
+            if (trainer)
+            {
+                trainer->drain();
+            }
+        }
+
+        void stopBackgroundTraining()
         {
-            if (params.size() != inputCount)
+            if (!trainer)
+            {
+                return;
+            }
+
+            trainer->drain();
+            trainer->copySnapshot(nn);
+            trainer.reset();
+            nn.thaw();
+        }
+
+        void refineSparse(Php::Parameters &params)
+        {
+            checkForeground();
+            checkTrainable();
+            checkPattern(params[0], params[1], true);
+            readSparse(params[0]);
+
+            try
+            {
+                nn.refine(sparse, params[1], params[2]);
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+        }
+
+        Php::Value predictSparse(Php::Parameters &params)
+        {
+            readSparse(params[0]);
+
+            try
+            {
+                // Like predict, this reads the published snapshot during background training
+                const vector<double>& prediction = trainer ? trainer->predict(sparse, context) : nn.forward_prop(sparse);
+
+                Php::Value array(prediction);
+
+                return array;
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+        }
+
+        // Predicts the inputs in params[first...] without allocating, and
+        // returns the outputs (which stay valid until the next prediction)
+        const double* compute(Php::Parameters &params, size_t first)
+        {
+            if (params.size() - first != inputCount)
             {
                 throw Php::Exception("Parameter count doesn't match input count.");
             }
 
-            vector<double> in;
-            in.resize(params.size());
+            for (size_t i = 0; i < inputCount; i++)
+            {
+                input[i] = params[first + i];
+            }
+
+            if (trainer)
+            {
+                // Snapshots change underneath us, so they are never cached
+                return trainer->predict(input, context).data();
+            }
+
+            const double* hit = cache.find(input.data(), nn.version());
+            if (hit)
+            {
+                return hit;
+            }
+
+            const double* prediction = nn.forward_prop(input).data();
+            cache.insert(input.data(), prediction, nn.version());
 
-            for (size_t i = 0; i < params.size(); i++)
+            return prediction;
+        }
+
+        // Stores values in the first count elements of array. (An array that
+        // already has those elements is updated in place.)
+        static void writeArray(Php::Value &array, const double* values, size_t count)
+        {
+            for (size_t i = 0; i < count; i++)
             {
-                in[i] = params[i];
+                array[(int) i] = values[i];
             }
+        }
 
-            const vector<double>& prediction = nn.forward_prop(in);
+        Php::Value predict(Php::Parameters &params)
+        {
+            const double* prediction = compute(params, 0);
 
-            Php::Value array(prediction);
+            Php::Array array;
+            writeArray(array, prediction, outputCount);
 
             return array;
         }
+
+        void predictInto(Php::Parameters &params)
+        {
+            if (params.size() < 1)
+            {
+                throw Php::Exception("predictInto needs an array to write into.");
+            }
+
+            const double* prediction = compute(params, 1);
+            writeArray(params[0], prediction, outputCount);
+        }
+
+        Php::Value prune(Php::Parameters &params)
+        {
+            checkForeground();
+            return (int64_t) nn.prune(params[0]);
+        }
+
+        Php::Value pruneToSparsity(Php::Parameters &params)
+        {
+            checkForeground();
+            double sparsity = params[0];
+            if (sparsity < 0.0 || sparsity > 1.0)
+            {
+                throw Php::Exception("Sparsity must be between 0 and 1.");
+            }
+
+            return (int64_t) nn.pruneToSparsity(sparsity);
+        }
+
+        void shrinkLayer(Php::Parameters &params)
+        {
+            checkForeground();
+            int64_t layer = params[0];
+            int64_t width = params[1];
+            if (layer < 0 || (size_t) layer + 1 >= nn.m_layers.size())
+            {
+                throw Php::Exception("Only hidden layers can be shrunk.");
+            }
+            if (width < 1)
+            {
+                throw Php::Exception("A layer must keep at least one unit.");
+            }
+
+            nn.shrinkLayer((size_t) layer, (size_t) width);
+        }
+
+        void save(Php::Parameters &params)
+        {
+            checkForeground();
+            try
+            {
+                nn.save(params[0].stringValue());
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+        }
+
+        void load(Php::Parameters &params)
+        {
+            checkForeground();
+            try
+            {
+                nn.load(params[0].stringValue());
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+
+            inputCount = nn.m_layers[0]->inputs();
+            outputCount = nn.m_layers[nn.m_layers.size() - 1]->outputs();
+            input.resize(inputCount);
+            cache.resize(cache.capacity(), inputCount, outputCount);
+        }
+
+        Php::Value getStats()
+        {
+            NetStats stats = nn.stats();
+
+            Php::Value result;
+            result["enabled"] = stats.enabled;
+            result["samples"] = (int64_t) stats.samples;
+            result["bytes_allocated"] = (int64_t) stats.bytes_allocated;
+            result["model_bytes"] = (int64_t) stats.model_bytes;
+            result["dropped"] = trainer ? (int64_t) trainer->dropped() : 0;
+            result["cache_size"] = (int64_t) cache.capacity();
+            result["cache_hits"] = (int64_t) cache.hits();
+            result["cache_misses"] = (int64_t) cache.misses();
+
+            Php::Value layers;
+            for (size_t i = 0; i < stats.layers.size(); i++)
+            {
+                const LayerStats& l = stats.layers[i];
+                Php::Value layer;
+                layer["forward_ns"] = (int64_t) l.forward_ns;
+                layer["backward_ns"] = (int64_t) l.backward_ns;
+                layer["update_ns"] = (int64_t) l.update_ns;
+                layer["flops"] = (int64_t) l.flops;
+                layer["threads"] = (int64_t) l.threads;
+                layers[(int) i] = layer;
+            }
+            result["layers"] = layers;
+
+            return result;
+        }
+};
+
+class NeuralNetworkEnsemble : public Php::Base
+{
+    private:
+        Ensemble ensemble;
+        vector<double> input;
+        vector<double> average;
+
+    public:
+        NeuralNetworkEnsemble() {}
+
+        virtual ~NeuralNetworkEnsemble() = default;
+
+        void add(Php::Parameters &params)
+        {
+            NeuralNetwork *pNetwork = params[0].implementation<NeuralNetwork>();
+            if (!pNetwork)
+            {
+                throw Php::Exception("Expected a NeuralNetwork.");
+            }
+
+            try
+            {
+                ensemble.add(pNetwork->network());
+            }
+            catch (const Ex &e)
+            {
+                throw Php::Exception(e.what());
+            }
+
+            input.resize(ensemble.inputs());
+            average.resize(ensemble.outputs());
+        }
+
+        Php::Value count()
+        {
+            return (int64_t) ensemble.size();
+        }
+
+        Php::Value predict(Php::Parameters &params)
+        {
+            if (ensemble.size() == 0)
+            {
+                throw Php::Exception("The ensemble is empty.");
+            }
+            if (params.size() != input.size())
+            {
+                throw Php::Exception("Parameter count doesn't match input count.");
+            }
+
+            for (size_t i = 0; i < input.size(); i++)
+            {
+                input[i] = params[i];
+            }
+
+            const vector<double>& predictions = ensemble.predict(input.data());
+            ensemble.mean(predictions, average.data());
+
+            size_t models = ensemble.size();
+            Php::Array perModel;
+            for (size_t m = 0; m < models; m++)
+            {
+                Php::Array outputs;
+                for (size_t i = 0; i < average.size(); i++)
+                {
+                    outputs[(int) i] = predictions[i * models + m];
+                }
+                perModel[(int) m] = outputs;
+            }
+
+            Php::Array result;
+            result["models"] = perModel;
+            result["mean"] = Php::Value(average);
+
+            return result;
+        }
 };
 
 /**
@@ -104,6 +795,17 @@ extern "C" {
         // for the entire duration of the process (that's why it's static)
         static Php::Extension extension("jpuck-neural-network", "1.0");
 
+        // the default number of predictions each network caches (0 turns the cache off)
+        extension.add(Php::Ini("neuralnetwork.prediction_cache", (int64_t) 0));
+
+        // the shared worker pool (0 threads means one per CPU), and how its
+        // workers are pinned: "none", "compact" or "scatter". (These are read
+        // by NeuralNetwork::configurePool. The pool itself starts the first
+        // time it is used, so a server that forks its workers after startup
+        // does not lose the threads.)
+        extension.add(Php::Ini("neuralnetwork.threads", (int64_t) 0));
+        extension.add(Php::Ini("neuralnetwork.pinning", "none"));
+
         // create a namespace
         Php::Namespace ns("jpuck");
 
@@ -123,9 +825,94 @@ extern "C" {
             Php::ByVal("input", Php::Type::Float)
             // TODO: figure out variadic type hints
         });
+        nnet.method<&NeuralNetwork::predictInto> ("predictInto", {
+            Php::ByRef("out", Php::Type::Array),
+            Php::ByVal("input", Php::Type::Float)
+        });
+        nnet.method<&NeuralNetwork::trainProcesses> ("trainProcesses", {
+            Php::ByVal("features", Php::Type::Array),
+            Php::ByVal("labels", Php::Type::Array),
+            Php::ByVal("options", Php::Type::Array, false)
+        });
+        nnet.method<&NeuralNetwork::trainPipeline> ("trainPipeline", {
+            Php::ByVal("features", Php::Type::Array),
+            Php::ByVal("labels", Php::Type::Array),
+            Php::ByVal("options", Php::Type::Array, false)
+        });
+        nnet.method<&NeuralNetwork::evaluate> ("evaluate", {
+            Php::ByVal("features", Php::Type::Array),
+            Php::ByVal("labels", Php::Type::Array)
+        });
+        nnet.method<&NeuralNetwork::search> ("search", {
+            Php::ByVal("features", Php::Type::Array),
+            Php::ByVal("labels", Php::Type::Array),
+            Php::ByVal("space", Php::Type::Array),
+            Php::ByVal("options", Php::Type::Array, false)
+        });
+        nnet.method<&NeuralNetwork::setMixedPrecision> ("setMixedPrecision", {
+            Php::ByVal("enabled", Php::Type::Bool)
+        });
+        nnet.method<&NeuralNetwork::setParallelForward> ("setParallelForward", {
+            Php::ByVal("enabled", Php::Type::Bool),
+            Php::ByVal("minWeights", Php::Type::Numeric, false)
+        });
+        nnet.method<&NeuralNetwork::freeze> ("freeze");
+        nnet.method<&NeuralNetwork::thaw> ("thaw");
+        nnet.method<&NeuralNetwork::enqueueRefine> ("enqueueRefine", {
+            Php::ByVal("input", Php::Type::Array),
+            Php::ByVal("output", Php::Type::Array),
+            Php::ByVal("bias", Php::Type::Float)
+        });
+        nnet.method<&NeuralNetwork::startBackgroundTraining> ("startBackgroundTraining", {
+            Php::ByVal("publishEvery", Php::Type::Numeric, false),
+            Php::ByVal("capacity", Php::Type::Numeric, false),
+            Php::ByVal("policy", Php::Type::Numeric, false),
+            Php::ByVal("batchSize", Php::Type::Numeric, false)
+        });
+        nnet.method<&NeuralNetwork::flushTraining> ("flushTraining");
+        nnet.method<&NeuralNetwork::stopBackgroundTraining> ("stopBackgroundTraining");
+        nnet.method<&NeuralNetwork::refineSparse> ("refineSparse", {
+            Php::ByVal("input", Php::Type::Array),
+            Php::ByVal("output", Php::Type::Array),
+            Php::ByVal("bias", Php::Type::Float)
+        });
+        nnet.method<&NeuralNetwork::predictSparse> ("predictSparse", {
+            Php::ByVal("input", Php::Type::Array)
+        });
+        nnet.method<&NeuralNetwork::prune> ("prune", {
+            Php::ByVal("threshold", Php::Type::Float)
+        });
+        nnet.method<&NeuralNetwork::pruneToSparsity> ("pruneToSparsity", {
+            Php::ByVal("sparsity", Php::Type::Float)
+        });
+        nnet.method<&NeuralNetwork::shrinkLayer> ("shrinkLayer", {
+            Php::ByVal("layer", Php::Type::Numeric),
+            Php::ByVal("width", Php::Type::Numeric)
+        });
+        nnet.method<&NeuralNetwork::save> ("save", {
+            Php::ByVal("path", Php::Type::String)
+        });
+        nnet.method<&NeuralNetwork::load> ("load", {
+            Php::ByVal("path", Php::Type::String)
+        });
+        nnet.method<&NeuralNetwork::getStats> ("getStats");
+        nnet.property("QUEUE_BLOCK", (int64_t) QUEUE_BLOCK, Php::Const);
+        nnet.property("QUEUE_DROP_NEWEST", (int64_t) QUEUE_DROP_NEWEST, Php::Const);
+        nnet.property("QUEUE_DROP_OLDEST", (int64_t) QUEUE_DROP_OLDEST, Php::Const);
 
         ns.add(std::move(nnet));
 
+        Php::Class<NeuralNetworkEnsemble> ensemble("NeuralNetworkEnsemble");
+        ensemble.method<&NeuralNetworkEnsemble::add> ("add", {
+            Php::ByVal("network", "jpuck\\NeuralNetwork")
+        });
+        ensemble.method<&NeuralNetworkEnsemble::count> ("count");
+        ensemble.method<&NeuralNetworkEnsemble::predict> ("predict", {
+            Php::ByVal("input", Php::Type::Float)
+            // TODO: figure out variadic type hints
+        });
+        ns.add(std::move(ensemble));
+
         // add the namespace to the extension
         extension.add(std::move(ns));
 
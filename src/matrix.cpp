@@ -10,6 +10,11 @@
 #include <fstream>
 #include <stdlib.h>
 #include <algorithm>
+#include <unordered_map>
+#include <atomic>
+#include <stdio.h>
+#include <locale.h>
+#include "threadpool.h"
 
 using std::string;
 using std::ifstream;
@@ -159,6 +164,171 @@ double Matrix::mostCommonValue(size_t col) const
 	return value;
 }
 
+void Matrix::toSparse(size_t row, SparseVector& out) const
+{
+	out.clear();
+	const vector<double>& r = m_data[row];
+	for(size_t i = 0; i < r.size(); i++)
+	{
+		if(r[i] != 0.0 && r[i] != UNKNOWN_VALUE)
+			out.add(i, r[i]);
+	}
+}
+
+// Running totals for one column over a range of rows
+struct ColumnAccumulator
+{
+	size_t count;
+	double mean;
+	double m2; // sum of squared differences from the mean
+	double min;
+	double max;
+	std::vector<size_t> enumCounts; // for nominal values
+	std::unordered_map<double, size_t> valueCounts; // for everything else
+	bool countValues; // false when the mode is not needed
+
+	ColumnAccumulator() : count(0), mean(0.0), m2(0.0), min(1e300), max(-1e300), countValues(true) {}
+
+	void add(double val)
+	{
+		count++;
+		double delta = val - mean;
+		mean += delta / count;
+		m2 += delta * (val - mean);
+		min = std::min(min, val);
+		max = std::max(max, val);
+		if(!countValues)
+			return;
+		size_t e = (size_t)val;
+		if(val >= 0.0 && e < enumCounts.size() && (double)e == val)
+			enumCounts[e]++;
+		else
+			valueCounts[val]++;
+	}
+
+	// Combines the totals from another range of rows (Chan et al.'s pairwise update)
+	void merge(const ColumnAccumulator& that)
+	{
+		if(that.count == 0)
+			return;
+		size_t n = count + that.count;
+		double delta = that.mean - mean;
+		m2 += that.m2 + delta * delta * ((double)count * that.count / n);
+		mean += delta * that.count / n;
+		count = n;
+		min = std::min(min, that.min);
+		max = std::max(max, that.max);
+		for(size_t i = 0; i < enumCounts.size(); i++)
+			enumCounts[i] += that.enumCounts[i];
+		for(std::unordered_map<double, size_t>::const_iterator it = that.valueCounts.begin(); it != that.valueCounts.end(); it++)
+			valueCounts[it->first] += it->second;
+	}
+
+	double mode() const
+	{
+		// Break ties toward the smaller value, like mostCommonValue does
+		size_t bestCount = 0;
+		double best = 0.0;
+		for(size_t i = 0; i < enumCounts.size(); i++)
+		{
+			if(enumCounts[i] > bestCount)
+			{
+				best = (double)i;
+				bestCount = enumCounts[i];
+			}
+		}
+		for(std::unordered_map<double, size_t>::const_iterator it = valueCounts.begin(); it != valueCounts.end(); it++)
+		{
+			if(it->second > bestCount || (it->second == bestCount && it->first < best))
+			{
+				best = it->first;
+				bestCount = it->second;
+			}
+		}
+		return best;
+	}
+};
+
+// Accumulates every column over rows [begin, end)
+static void accumulateColumns(const MatrixView& data, size_t begin, size_t end, vector<ColumnAccumulator>& acc)
+{
+	size_t c = acc.size();
+	for(size_t i = begin; i < end; i++)
+	{
+		const double* r = data[i];
+		for(size_t j = 0; j < c; j++)
+		{
+			if(r[j] != UNKNOWN_VALUE)
+				acc[j].add(r[j]);
+		}
+	}
+}
+
+// One range of rows for each thread of a ThreadPool
+class ColumnStatsJob : public ThreadPool::Job
+{
+public:
+	const MatrixView& m_data;
+	bool m_with_mode;
+	vector< vector<ColumnAccumulator> > m_partials;
+
+	ColumnStatsJob(const MatrixView& data, bool withMode, size_t parts)
+	: m_data(data), m_with_mode(withMode), m_partials(parts)
+	{
+	}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		// Each thread allocates its own accumulators, so they are local to it
+		vector<ColumnAccumulator>& acc = m_partials[part];
+		acc.resize(m_data.cols());
+		for(size_t j = 0; j < acc.size(); j++)
+		{
+			acc[j].countValues = m_with_mode;
+			if(m_with_mode)
+				acc[j].enumCounts.resize(m_data.valueCount(j));
+		}
+		size_t r = m_data.rows();
+		accumulateColumns(m_data, r * part / parts, r * (part + 1) / parts, acc);
+	}
+};
+
+void Matrix::columnStats(vector<ColumnStats>& out, bool withMode) const
+{
+	MatrixView(*this).columnStats(out, withMode);
+}
+
+void MatrixView::columnStats(vector<ColumnStats>& out, bool withMode) const
+{
+	size_t c = cols();
+	size_t r = rows();
+
+	// Only split the work when there is enough of it to pay for the handoff
+	ThreadPool* pPool = r * c >= 1000000 ? &ThreadPool::shared() : NULL;
+	size_t threadCount = pPool && r >= pPool->size() ? pPool->size() : 1;
+	ColumnStatsJob job(*this, withMode, threadCount);
+	if(threadCount > 1)
+		pPool->run(job);
+	else
+		job.run(0, 1);
+	vector< vector<ColumnAccumulator> >& partials = job.m_partials;
+
+	out.resize(c);
+	for(size_t j = 0; j < c; j++)
+	{
+		ColumnAccumulator& acc = partials[0][j];
+		for(size_t t = 1; t < threadCount; t++)
+			acc.merge(partials[t][j]);
+		ColumnStats& s = out[j];
+		s.count = acc.count;
+		s.mean = acc.count > 0 ? acc.mean : 0.0;
+		s.variance = acc.count > 0 ? acc.m2 / acc.count : 0.0;
+		s.min = acc.min;
+		s.max = acc.max;
+		s.mode = acc.mode();
+	}
+}
+
 void Matrix::copyPart(const Matrix& that, size_t rowBegin, size_t colBegin, size_t rowCount, size_t colCount)
 {
 	if(rowBegin + rowCount > that.rows() || colBegin + colCount > that.cols())
@@ -195,66 +365,194 @@ string toLower(string strToConvert)
 	return strToConvert;//return the converted string
 }
 
-void Matrix::saveARFF(string filename) const
+// Switches the calling thread to the C locale's number format until it goes
+// out of scope. snprintf follows LC_NUMERIC, which PHP's setlocale can change
+// (a German locale writes 0,5), while to_str's streams always use the
+// classic locale.
+class ClassicNumbers
 {
-	std::ofstream s;
-	s.exceptions(std::ios::failbit|std::ios::badbit);
-	try
+protected:
+	locale_t m_old;
+
+public:
+	ClassicNumbers()
 	{
-		s.open(filename.c_str(), std::ios::binary);
+		static locale_t classic = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+		m_old = classic ? uselocale(classic) : (locale_t)0;
 	}
-	catch(const std::exception&)
+
+	~ClassicNumbers()
 	{
-		throw Ex("Error creating file: ", filename);
+		if(m_old)
+			uselocale(m_old);
 	}
-	s.precision(10);
-	s << "@RELATION " << m_filename << "\n";
-	for(size_t i = 0; i < m_attr_name.size(); i++)
+};
+
+// Formats the data lines of an ARFF file. Everything that does not depend
+// on the row is looked up once, up front.
+class ArffFormatter
+{
+public:
+	const Matrix& m_matrix;
+	vector<size_t> m_value_counts;
+	vector< vector<string> > m_value_names;
+
+	ArffFormatter(const Matrix& m)
+	: m_matrix(m), m_value_counts(m.cols()), m_value_names(m.cols())
 	{
-		s << "@ATTRIBUTE " << m_attr_name[i];
-		if(m_attr_name[i].size() == 0)
-			s << "x";
-		size_t vals = valueCount(i);
-		if(vals == 0)
-			s << " REAL\n";
-		else
+		for(size_t j = 0; j < m.cols(); j++)
 		{
-			s << " {";
-			for(size_t j = 0; j < vals; j++)
-			{
-				s << attrValue(i, j);
-				if(j + 1 < vals)
-					s << ",";
-			}
-			s << "}\n";
+			m_value_counts[j] = m.valueCount(j);
+			for(size_t k = 0; k < m_value_counts[j]; k++)
+				m_value_names[j].push_back(m.attrValue(j, k));
 		}
 	}
-	s << "@DATA\n";
-	for(size_t i = 0; i < rows(); i++)
+
+	// Appends rows [begin, end) to out
+	void format(size_t begin, size_t end, string& out) const
 	{
-		const std::vector<double>& r = (*this)[i];
-		for(size_t j = 0; j < cols(); j++)
+		ClassicNumbers classic;
+		size_t c = m_value_counts.size();
+		char num[32];
+		for(size_t i = begin; i < end; i++)
 		{
-			if(r[j] == UNKNOWN_VALUE)
-				s << "?";
-			else
+			const double* r = m_matrix[i].data();
+			for(size_t j = 0; j < c; j++)
 			{
-				size_t vals = valueCount(j);
-				if(vals == 0)
-					s << to_str(r[j]);
+				if(r[j] == UNKNOWN_VALUE)
+					out += '?';
+				else if(m_value_counts[j] == 0)
+				{
+					// The same digits as to_str, which prints with precision 14
+					int n = snprintf(num, sizeof(num), "%.14g", r[j]);
+					out.append(num, n);
+				}
 				else
 				{
 					size_t val = (size_t)r[j];
-					if(val >= vals)
+					if(val >= m_value_counts[j])
 						throw Ex("value out of range");
-					s << attrValue(j, val);
+					out += m_value_names[j][val];
 				}
+				if(j + 1 < c)
+					out += ',';
 			}
-			if(j + 1 < cols())
-				s << ",";
+			out += '\n';
 		}
-		s << "\n";
 	}
+};
+
+// Formats one block of rows, one slice for each thread of a ThreadPool. The
+// buffers are kept from block to block, so they stop allocating.
+class ArffJob : public ThreadPool::Job
+{
+public:
+	const ArffFormatter& m_formatter;
+	size_t m_begin;
+	size_t m_end;
+	vector<string> m_buffers;
+	std::atomic<bool> m_failed;
+
+	ArffJob(const ArffFormatter& formatter, size_t parts)
+	: m_formatter(formatter), m_begin(0), m_end(0), m_buffers(parts), m_failed(false)
+	{
+	}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		size_t rows = m_end - m_begin;
+		string& buf = m_buffers[part];
+		buf.clear();
+		try
+		{
+			m_formatter.format(m_begin + rows * part / parts, m_begin + rows * (part + 1) / parts, buf);
+		}
+		catch(...)
+		{
+			m_failed.store(true);
+		}
+	}
+};
+
+// Writes buf to file, and empties it
+static void writeBlock(FILE* file, string& buf, const string& filename)
+{
+	if(buf.size() > 0 && fwrite(buf.data(), 1, buf.size(), file) != buf.size())
+		throw Ex("Error writing file: ", filename);
+	buf.clear();
+}
+
+void Matrix::saveARFF(string filename, bool parallel) const
+{
+	FILE* file = fopen(filename.c_str(), "wb");
+	if(!file)
+		throw Ex("Error creating file: ", filename);
+	try
+	{
+		string buf;
+		buf.reserve(ARFF_BLOCK_BYTES + 4096);
+		buf += "@RELATION " + m_filename + "\n";
+		for(size_t i = 0; i < m_attr_name.size(); i++)
+		{
+			buf += "@ATTRIBUTE " + m_attr_name[i];
+			if(m_attr_name[i].size() == 0)
+				buf += "x";
+			size_t vals = valueCount(i);
+			if(vals == 0)
+				buf += " REAL\n";
+			else
+			{
+				buf += " {";
+				for(size_t j = 0; j < vals; j++)
+				{
+					buf += attrValue(i, j);
+					if(j + 1 < vals)
+						buf += ",";
+				}
+				buf += "}\n";
+			}
+		}
+		buf += "@DATA\n";
+
+		ArffFormatter formatter(*this);
+		ThreadPool* pPool = parallel ? &ThreadPool::shared() : NULL;
+		if(pPool && pPool->size() > 1)
+		{
+			// Each block gives every thread ARFF_BLOCK_ROWS rows, and is
+			// written in order before the next one is formatted
+			writeBlock(file, buf, filename);
+			ArffJob job(formatter, pPool->size());
+			size_t blockRows = ARFF_BLOCK_ROWS * pPool->size();
+			for(size_t i = 0; i < rows(); i += blockRows)
+			{
+				job.m_begin = i;
+				job.m_end = std::min(rows(), i + blockRows);
+				pPool->run(job);
+				if(job.m_failed.load())
+					throw Ex("value out of range");
+				for(size_t p = 0; p < job.m_buffers.size(); p++)
+					writeBlock(file, job.m_buffers[p], filename);
+			}
+		}
+		else
+		{
+			// Flush whenever the buffer passes the block size
+			for(size_t i = 0; i < rows(); i += ARFF_BLOCK_ROWS)
+			{
+				formatter.format(i, std::min(rows(), i + ARFF_BLOCK_ROWS), buf);
+				if(buf.size() >= ARFF_BLOCK_BYTES)
+					writeBlock(file, buf, filename);
+			}
+			writeBlock(file, buf, filename);
+		}
+	}
+	catch(...)
+	{
+		fclose(file);
+		throw;
+	}
+	if(fclose(file) != 0)
+		throw Ex("Error writing file: ", filename);
 }
 
 void Matrix::loadARFF(string fileName)
@@ -432,3 +730,54 @@ void Matrix::checkCompatibility(const Matrix& that) const
 	}
 }
 
+
+
+
+
+MatrixView::MatrixView(const Matrix& m)
+: m_pMatrix(&m), m_row_begin(0), m_row_count(m.rows()), m_row_stride(1), m_col_begin(0), m_col_count(m.cols())
+{
+}
+
+MatrixView::MatrixView(const Matrix& m, size_t rowBegin, size_t rowCount, size_t colBegin, size_t colCount, size_t rowStride)
+: m_pMatrix(&m), m_row_begin(rowBegin), m_row_count(rowCount), m_row_stride(rowStride), m_col_begin(colBegin), m_col_count(colCount)
+{
+	if(colBegin + colCount > m.cols())
+		throw Ex("out of range");
+	if(rowCount > 0 && (rowStride == 0 || rowBegin + (rowCount - 1) * rowStride >= m.rows()))
+		throw Ex("out of range");
+}
+
+MatrixView::MatrixView(const Matrix& m, const vector<size_t>& rows, size_t colBegin, size_t colCount)
+: m_pMatrix(&m), m_indexes(rows), m_row_begin(0), m_row_count(0), m_row_stride(1), m_col_begin(colBegin), m_col_count(colCount)
+{
+	if(colBegin + colCount > m.cols())
+		throw Ex("out of range");
+	for(size_t i = 0; i < rows.size(); i++)
+	{
+		if(rows[i] >= m.rows())
+			throw Ex("Row ", to_str(rows[i]), " is out of range");
+	}
+}
+
+MatrixView MatrixView::columns(size_t colBegin, size_t colCount) const
+{
+	if(colBegin + colCount > m_col_count)
+		throw Ex("out of range");
+	MatrixView view(*this);
+	view.m_col_begin += colBegin;
+	view.m_col_count = colCount;
+	return view;
+}
+
+MatrixView MatrixView::select(const vector<size_t>& rows) const
+{
+	vector<size_t> source(rows.size());
+	for(size_t i = 0; i < rows.size(); i++)
+	{
+		if(rows[i] >= this->rows())
+			throw Ex("Row ", to_str(rows[i]), " is out of range");
+		source[i] = sourceRow(rows[i]);
+	}
+	return MatrixView(*m_pMatrix, source, m_col_begin, m_col_count);
+}
@@ -15,6 +15,53 @@ class Rand;
 
 #define UNKNOWN_VALUE -1e308
 
+/// saveARFF writes to the file whenever this much text has been formatted
+#define ARFF_BLOCK_BYTES (1 << 20)
+
+/// The rows each thread formats at a time when saveARFF runs in parallel
+#define ARFF_BLOCK_ROWS 4096
+
+
+/// Summary statistics for one column of a Matrix. (Elements with the value UNKNOWN_VALUE are ignored.)
+struct ColumnStats
+{
+	size_t count; // the number of known values
+	double mean;
+	double variance; // the population variance
+	double min;
+	double max;
+	double mode; // the most common value (the smallest one, if there is a tie), or 0 when it was not asked for
+
+	ColumnStats() : count(0), mean(0.0), variance(0.0), min(1e300), max(-1e300), mode(0.0) {}
+};
+
+
+/// A vector that stores only its non-zero elements, as parallel arrays
+/// of indexes and values. (The indexes do not need to be sorted, but
+/// each one should appear only once.)
+struct SparseVector
+{
+	std::vector<size_t> indexes;
+	std::vector<double> values;
+
+	/// Returns the number of non-zero elements
+	size_t size() const { return indexes.size(); }
+
+	/// Removes all the elements
+	void clear()
+	{
+		indexes.clear();
+		values.clear();
+	}
+
+	/// Appends one non-zero element
+	void add(size_t index, double value)
+	{
+		indexes.push_back(index);
+		values.push_back(value);
+	}
+};
+
 
 // This stores a matrix, A.K.A. data set, A.K.A. table. Each element is
 // represented as a double value. Nominal values are represented using their
@@ -61,8 +108,10 @@ public:
 	/// Loads the matrix from an ARFF file
 	void loadARFF(std::string filename);
 
-	/// Saves the matrix to an ARFF file
-	void saveARFF(std::string filename) const;
+	/// Saves the matrix to an ARFF file. The text is formatted into a buffer
+	/// and written in large blocks. If parallel is true, the rows are
+	/// formatted by the threads of the shared ThreadPool.
+	void saveARFF(std::string filename, bool parallel = false) const;
 
 	/// Makes a rows x columns matrix of *ALL CONTINUOUS VALUES*.
 	/// This method wipes out any data currently in the matrix. It also
@@ -123,6 +172,16 @@ public:
 	/// Returns the most common value in the specified column. (Elements with the value UNKNOWN_VALUE are ignored.)
 	double mostCommonValue(size_t col) const;
 
+	/// Copies the non-zero elements of the specified row into out. (Elements with the value UNKNOWN_VALUE are left out too.)
+	void toSparse(size_t row, SparseVector& out) const;
+
+	/// Computes the statistics of every column in a single pass over the data.
+	/// Large matrices are split into row ranges that are scanned in parallel.
+	/// (Elements with the value UNKNOWN_VALUE are ignored.) Finding the mode
+	/// means counting every distinct value, which costs a hash table entry
+	/// per value for real-valued columns, so withMode = false skips it.
+	void columnStats(std::vector<ColumnStats>& out, bool withMode = true) const;
+
 	/// Copies the specified rectangular portion of that matrix, and adds it to the bottom of this matrix.
 	/// (If colCount does not match the number of columns in this matrix, then this matrix will be cleared first.)
 	void copyPart(const Matrix& that, size_t rowBegin, size_t colBegin, size_t rowCount, size_t colCount);
@@ -136,4 +195,67 @@ public:
 };
 
 
+/// A read-only window onto some of the rows and a range of the columns of a
+/// Matrix. It points into the matrix instead of copying it, so splitting a
+/// data set into features and labels, or into folds, costs almost nothing.
+/// (The matrix must outlive the view, and must not be resized meanwhile.)
+/// Row i of a view is row rowBegin + i * rowStride of the matrix, or row
+/// indexes[i] if the view was made from a list of row indexes.
+///
+/// Matrix data;
+/// data.loadARFF("data.arff");
+/// MatrixView x(data, 0, data.rows(), 0, 8); // the first 8 columns
+/// MatrixView y(data, 0, data.rows(), 8, 1); // the 9th column
+/// nn.train(x, y);
+///
+class MatrixView
+{
+protected:
+	const Matrix* m_pMatrix;
+	std::vector<size_t> m_indexes; // the selected rows, or empty to use the range below
+	size_t m_row_begin;
+	size_t m_row_count;
+	size_t m_row_stride;
+	size_t m_col_begin;
+	size_t m_col_count;
+
+public:
+	/// Views the whole matrix. (This is not explicit, so a Matrix can be
+	/// passed wherever a MatrixView is expected.)
+	MatrixView(const Matrix& m);
+
+	/// Views rowCount rows, starting at rowBegin and stepping by rowStride,
+	/// and colCount columns starting at colBegin
+	MatrixView(const Matrix& m, size_t rowBegin, size_t rowCount, size_t colBegin, size_t colCount, size_t rowStride = 1);
+
+	/// Views the specified rows of the matrix, in that order, and colCount
+	/// columns starting at colBegin
+	MatrixView(const Matrix& m, const std::vector<size_t>& rows, size_t colBegin, size_t colCount);
+
+	/// Returns the number of rows in the view
+	size_t rows() const { return m_indexes.size() > 0 ? m_indexes.size() : m_row_count; }
+
+	/// Returns the number of columns in the view
+	size_t cols() const { return m_col_count; }
+
+	/// Returns the matrix row that row i of the view refers to
+	size_t sourceRow(size_t i) const { return m_indexes.size() > 0 ? m_indexes[i] : m_row_begin + i * m_row_stride; }
+
+	/// Returns a pointer to the first element of row i of the view
+	const double* operator [](size_t i) const { return (*m_pMatrix)[sourceRow(i)].data() + m_col_begin; }
+
+	/// Returns the number of values of the specified column of the view
+	size_t valueCount(size_t col) const { return m_pMatrix->valueCount(m_col_begin + col); }
+
+	/// Returns a view of colCount of these columns, starting at colBegin
+	MatrixView columns(size_t colBegin, size_t colCount) const;
+
+	/// Returns a view of the specified rows of this view
+	MatrixView select(const std::vector<size_t>& rows) const;
+
+	/// Like Matrix::columnStats, for the columns of this view
+	void columnStats(std::vector<ColumnStats>& out, bool withMode = true) const;
+};
+
+
 #endif // MATRIX_H
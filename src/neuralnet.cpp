@@ -7,23 +7,18 @@
 #include "error.h"
 #include "string.h"
 #include "rand.h"
+#include "threadpool.h"
 #include <math.h>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <fstream>
 
 using std::vector;
 
 
 
 
-double activation(double x)
-{
-	if(x >= 700.0) // Don't trigger a floating point exception
-		return 1.0;
-	if(x < -700.0) // Don't trigger a floating point exception
-		return -1.0;
-	return tanh(x);
-}
-
 double activationDerivative(double net, double activation)
 {
 	return 1.0 - (activation * activation);
@@ -33,6 +28,7 @@ double activationDerivative(double net, double activation)
 
 
 Layer::Layer(size_t inSize, size_t outSize)
+: m_pruned(false)
 {
 	m_weights.setSize(outSize, inSize);
 	m_bias.resize(outSize);
@@ -44,43 +40,234 @@ Layer::Layer(size_t inSize, size_t outSize)
 
 void Layer::init(Rand& rand)
 {
-	double dev = std::max(0.3, 1.0 / m_weights.cols());
+	double dev = std::max(0.3, 1.0 / inputs());
+	if(m_pruned)
+	{
+		// Only the weights that survived pruning get new values
+		rand.fillNormal(m_values.data(), m_values.size());
+		for(size_t j = 0; j < m_values.size(); j++)
+			m_values[j] *= dev;
+	}
 	for(size_t i = 0; i < m_weights.rows(); i++)
 	{
 		vector<double>& row = m_weights[i];
-		for(size_t j = 0; j < m_weights.cols(); j++)
-		{
-			row[j] = dev * rand.normal();
-		}
+		rand.fillNormal(row.data(), row.size());
+		for(size_t j = 0; j < row.size(); j++)
+			row[j] *= dev;
 	}
-	for(size_t j = 0; j < m_weights.rows(); j++)
+	rand.fillNormal(m_bias.data(), m_bias.size());
+	for(size_t j = 0; j < m_bias.size(); j++)
+		m_bias[j] *= dev;
+}
+
+double dotProduct(const double* a, const double* b, size_t n)
+{
+	double d = 0.0;
+	for(size_t i = 0; i < n; i++)
+		d += a[i] * b[i];
+	return d;
+}
+
+void Layer::feed_forward(const double* in)
+{
+	feed_forward(in, 0, outputs());
+}
+
+void Layer::feed_forward(const double* in, size_t begin, size_t end)
+{
+	if(m_pruned)
 	{
-		m_bias[j] = dev * rand.normal();
+		feed_forward_pruned(in, begin, end);
+		return;
+	}
+	size_t cols = m_weights.cols();
+	for(size_t i = begin; i < end; i++)
+	{
+		m_net[i] = dotProduct(in, m_weights[i].data(), cols) + m_bias[i];
+		m_activation[i] = activation(m_net[i]);
 	}
 }
 
-double dotProduct(const vector<double>& a, const vector<double>& b)
+// Eight independent partial sums, so the compiler can keep them in one SIMD
+// register. (Unlike dotProduct, the order of the sums is not sequential.)
+static float dotProduct32(const float* a, const float* b, size_t n)
 {
-	vector<double>::const_iterator itA = a.begin();
-	vector<double>::const_iterator itB = b.begin();
-	double d = 0.0;
-	while(itA != a.end())
-		d += *(itA++) * *(itB++);
+	float s[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8)
+	{
+		for(size_t k = 0; k < 8; k++)
+			s[k] += a[i + k] * b[i + k];
+	}
+	float d = ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+	for(; i < n; i++)
+		d += a[i] * b[i];
 	return d;
 }
 
-void Layer::feed_forward(const vector<double>& in)
+void Layer::syncWorkingCopy()
+{
+	if(m_pruned)
+	{
+		dropWorkingCopy();
+		return;
+	}
+	size_t cols = m_weights.cols();
+	m_weights32.resize(m_weights.rows() * cols);
+	for(size_t i = 0; i < m_weights.rows(); i++)
+	{
+		const double* pRow = m_weights[i].data();
+		float* pRow32 = &m_weights32[i * cols];
+		for(size_t j = 0; j < cols; j++)
+			pRow32[j] = (float)pRow[j];
+	}
+	m_bias32.resize(m_bias.size());
+	for(size_t i = 0; i < m_bias.size(); i++)
+		m_bias32[i] = (float)m_bias[i];
+}
+
+void Layer::dropWorkingCopy()
+{
+	vector<float>().swap(m_weights32);
+	vector<float>().swap(m_bias32);
+	vector<float>().swap(m_scratch32);
+}
+
+void Layer::feed_forward32(const double* in)
+{
+	size_t cols = inputs();
+	m_scratch32.resize(cols);
+	float* pIn = m_scratch32.data();
+	for(size_t i = 0; i < cols; i++)
+		pIn[i] = (float)in[i];
+	for(size_t i = 0; i < m_bias.size(); i++)
+	{
+		m_net[i] = dotProduct32(pIn, &m_weights32[i * cols], cols) + m_bias32[i];
+		m_activation[i] = activation(m_net[i]);
+	}
+}
+
+void Layer::backprop32(const Layer& from)
+{
+	// Scatter each error back along its row of weights, so the inner loop
+	// is a contiguous fp32 axpy rather than a strided column walk
+	size_t cols = from.inputs();
+	m_scratch32.assign(cols, 0.0f);
+	float* pErr = m_scratch32.data();
+	for(size_t j = 0; j < from.outputs(); j++)
+	{
+		const float* pRow = &from.m_weights32[j * cols];
+		float e = (float)from.m_error[j];
+		for(size_t i = 0; i < cols; i++)
+			pErr[i] += pRow[i] * e;
+	}
+	for(size_t i = 0; i < cols; i++)
+		m_error[i] = pErr[i] * activationDerivative(m_net[i], m_activation[i]);
+}
+
+void Layer::feed_forward_pruned(const double* in, size_t begin, size_t end)
+{
+	// A sparse matrix times dense vector product over the CSR weights. The
+	// kept weights are visited in column order, so the sums are the same as
+	// the dense product with the pruned weights set to zero.
+	const size_t* pStarts = m_row_starts.data();
+	const unsigned int* pColumns = m_columns.data();
+	const double* pValues = m_values.data();
+	for(size_t i = begin; i < end; i++)
+	{
+		double d = 0.0;
+		for(size_t k = pStarts[i]; k < pStarts[i + 1]; k++)
+			d += in[pColumns[k]] * pValues[k];
+		m_net[i] = d + m_bias[i];
+		m_activation[i] = activation(m_net[i]);
+	}
+}
+
+void Layer::feed_forward(const SparseVector& in)
 {
+	if(m_pruned)
+	{
+		scatter(in);
+		feed_forward_pruned(m_scatter.data(), 0, outputs());
+		unscatter(in);
+		return;
+	}
+	const size_t* pIndexes = in.indexes.data();
+	const double* pValues = in.values.data();
+	size_t n = in.size();
 	for(size_t i = 0; i < m_weights.rows(); i++)
 	{
-		m_net[i] = dotProduct(in, m_weights[i]) + m_bias[i];
+		const double* pRow = m_weights[i].data();
+		double d = 0.0;
+		for(size_t k = 0; k < n; k++)
+			d += pValues[k] * pRow[pIndexes[k]];
+		m_net[i] = d + m_bias[i];
 		m_activation[i] = activation(m_net[i]);
 	}
 }
 
-void Layer::backprop(const Layer& from)
+void Layer::compute(const double* in, double* out) const
+{
+	compute(in, out, 0, outputs());
+}
+
+void Layer::compute(const double* in, double* out, size_t begin, size_t end) const
+{
+	// The same sums as feed_forward, in the same order, so the results are identical
+	if(m_pruned)
+	{
+		for(size_t i = begin; i < end; i++)
+		{
+			double d = 0.0;
+			for(size_t k = m_row_starts[i]; k < m_row_starts[i + 1]; k++)
+				d += in[m_columns[k]] * m_values[k];
+			out[i] = activation(d + m_bias[i]);
+		}
+		return;
+	}
+	size_t cols = m_weights.cols();
+	for(size_t i = begin; i < end; i++)
+		out[i] = activation(dotProduct(in, m_weights[i].data(), cols) + m_bias[i]);
+}
+
+void Layer::compute(const SparseVector& in, double* scatter, double* out) const
 {
+	if(m_pruned)
+	{
+		for(size_t k = 0; k < in.size(); k++)
+			scatter[in.indexes[k]] = in.values[k];
+		compute(scatter, out);
+		for(size_t k = 0; k < in.size(); k++)
+			scatter[in.indexes[k]] = 0.0;
+		return;
+	}
 	for(size_t i = 0; i < m_weights.rows(); i++)
+	{
+		const double* pRow = m_weights[i].data();
+		double d = 0.0;
+		for(size_t k = 0; k < in.size(); k++)
+			d += in.values[k] * pRow[in.indexes[k]];
+		out[i] = activation(d + m_bias[i]);
+	}
+}
+
+void Layer::backprop(const Layer& from)
+{
+	if(from.m_pruned)
+	{
+		// Scatter each error back along the weights that are still there
+		std::fill(m_error.begin(), m_error.end(), 0.0);
+		for(size_t j = 0; j < from.m_bias.size(); j++)
+		{
+			for(size_t k = from.m_row_starts[j]; k < from.m_row_starts[j + 1]; k++)
+			{
+				size_t i = from.m_columns[k];
+				m_error[i] += from.m_values[k] * from.m_error[j] * activationDerivative(m_net[i], m_activation[i]);
+			}
+		}
+		return;
+	}
+	for(size_t i = 0; i < m_bias.size(); i++)
 	{
 		double e = 0.0;
 		for(size_t j = 0; j < from.m_weights.rows(); j++)
@@ -89,8 +276,37 @@ void Layer::backprop(const Layer& from)
 	}
 }
 
-void Layer::update_weights(const vector<double>& in, double learning_rate)
+void Layer::update_weights(const double* in, double learning_rate)
 {
+	if(m_pruned)
+	{
+		// Pruned weights stay pruned
+		for(size_t j = 0; j < m_bias.size(); j++)
+		{
+			for(size_t k = m_row_starts[j]; k < m_row_starts[j + 1]; k++)
+				m_values[k] += learning_rate * m_error[j] * in[m_columns[k]];
+			m_bias[j] += learning_rate * m_error[j];
+		}
+		return;
+	}
+	if(hasWorkingCopy())
+	{
+		// Round each updated master weight into the working copy while it is in a register
+		size_t cols = m_weights.cols();
+		for(size_t j = 0; j < m_weights.rows(); j++)
+		{
+			double* pRow = m_weights[j].data();
+			float* pRow32 = &m_weights32[j * cols];
+			for(size_t i = 0; i < cols; i++)
+			{
+				pRow[i] += learning_rate * m_error[j] * in[i];
+				pRow32[i] = (float)pRow[i];
+			}
+			m_bias[j] += learning_rate * m_error[j];
+			m_bias32[j] = (float)m_bias[j];
+		}
+		return;
+	}
 	for(size_t j = 0; j < m_weights.rows(); j++)
 	{
 		for(size_t i = 0; i < m_weights.cols(); i++)
@@ -99,6 +315,255 @@ void Layer::update_weights(const vector<double>& in, double learning_rate)
 	}
 }
 
+void Layer::update_weights(const SparseVector& in, double learning_rate)
+{
+	if(m_pruned)
+	{
+		scatter(in);
+		update_weights(m_scatter.data(), learning_rate);
+		unscatter(in);
+		return;
+	}
+	const size_t* pIndexes = in.indexes.data();
+	const double* pValues = in.values.data();
+	size_t n = in.size();
+	for(size_t j = 0; j < m_weights.rows(); j++)
+	{
+		double* pRow = m_weights[j].data();
+		double step = learning_rate * m_error[j];
+		for(size_t k = 0; k < n; k++)
+			pRow[pIndexes[k]] += step * pValues[k];
+		m_bias[j] += step;
+	}
+}
+
+void Layer::scatter(const SparseVector& in)
+{
+	if(m_scatter.size() != inputs())
+		m_scatter.assign(inputs(), 0.0);
+	for(size_t k = 0; k < in.size(); k++)
+		m_scatter[in.indexes[k]] = in.values[k];
+}
+
+void Layer::unscatter(const SparseVector& in)
+{
+	for(size_t k = 0; k < in.size(); k++)
+		m_scatter[in.indexes[k]] = 0.0;
+}
+
+size_t Layer::prune(double threshold)
+{
+	size_t rows = outputs();
+	size_t cols = inputs();
+	vector<size_t> starts(rows + 1);
+	vector<unsigned int> columns;
+	vector<double> values;
+	for(size_t i = 0; i < rows; i++)
+	{
+		starts[i] = values.size();
+		if(m_pruned)
+		{
+			for(size_t k = m_row_starts[i]; k < m_row_starts[i + 1]; k++)
+			{
+				if(m_values[k] != 0.0 && std::abs(m_values[k]) >= threshold)
+				{
+					columns.push_back(m_columns[k]);
+					values.push_back(m_values[k]);
+				}
+			}
+		}
+		else
+		{
+			const vector<double>& row = m_weights[i];
+			for(size_t j = 0; j < cols; j++)
+			{
+				if(row[j] != 0.0 && std::abs(row[j]) >= threshold)
+				{
+					columns.push_back((unsigned int)j);
+					values.push_back(row[j]);
+				}
+			}
+		}
+	}
+	starts[rows] = values.size();
+
+	// Drop the dense rows, but keep the column count
+	m_weights.setSize(0, cols);
+	m_row_starts.swap(starts);
+	m_columns.swap(columns);
+	m_values.swap(values);
+	m_pruned = true;
+	return m_values.size();
+}
+
+size_t Layer::pruneToSparsity(double sparsity)
+{
+	size_t total = inputs() * outputs();
+	size_t target = (size_t)(std::min(1.0, std::max(0.0, sparsity)) * total);
+
+	// Find the magnitude of the weight that would make the target count
+	vector<double> mags;
+	mags.reserve(weightCount());
+	if(m_pruned)
+	{
+		for(size_t k = 0; k < m_values.size(); k++)
+		{
+			if(m_values[k] != 0.0)
+				mags.push_back(std::abs(m_values[k]));
+		}
+	}
+	else
+	{
+		for(size_t i = 0; i < m_weights.rows(); i++)
+		{
+			for(size_t j = 0; j < m_weights.cols(); j++)
+			{
+				if(m_weights[i][j] != 0.0)
+					mags.push_back(std::abs(m_weights[i][j]));
+			}
+		}
+	}
+	size_t zeros = total - mags.size();
+	double threshold = 0.0;
+	if(target > zeros)
+	{
+		size_t k = target - zeros;
+		if(k >= mags.size())
+			threshold = std::numeric_limits<double>::infinity();
+		else
+		{
+			std::nth_element(mags.begin(), mags.begin() + k, mags.end());
+			threshold = mags[k];
+		}
+	}
+	return prune(threshold);
+}
+
+void Layer::densify()
+{
+	if(!m_pruned)
+		return;
+	size_t cols = inputs();
+	m_weights.setSize(m_bias.size(), cols);
+	for(size_t i = 0; i < m_bias.size(); i++)
+	{
+		for(size_t k = m_row_starts[i]; k < m_row_starts[i + 1]; k++)
+			m_weights[i][m_columns[k]] = m_values[k];
+	}
+	vector<size_t>().swap(m_row_starts);
+	vector<unsigned int>().swap(m_columns);
+	vector<double>().swap(m_values);
+	vector<double>().swap(m_scatter);
+	m_pruned = false;
+}
+
+Layer* Layer::clone() const
+{
+	Layer* pLayer = new Layer(inputs(), outputs());
+	if(m_pruned)
+	{
+		pLayer->m_weights.setSize(0, inputs());
+		pLayer->m_pruned = true;
+		pLayer->m_row_starts = m_row_starts;
+		pLayer->m_columns = m_columns;
+		pLayer->m_values = m_values;
+	}
+	else
+	{
+		for(size_t i = 0; i < m_weights.rows(); i++)
+			pLayer->m_weights[i] = m_weights[i];
+	}
+	pLayer->m_bias = m_bias;
+	if(m_net.size() == 0)
+		pLayer->release();
+	return pLayer;
+}
+
+void Layer::release()
+{
+	vector<double>().swap(m_net);
+	vector<double>().swap(m_activation);
+	vector<double>().swap(m_error);
+	vector<double>().swap(m_scatter);
+	dropWorkingCopy();
+}
+
+void Layer::restore()
+{
+	m_net.resize(outputs());
+	m_activation.resize(outputs());
+	m_error.resize(outputs());
+}
+
+size_t Layer::weightCount() const
+{
+	return m_pruned ? m_values.size() : m_weights.rows() * m_weights.cols();
+}
+
+void Layer::getParameters(double* out) const
+{
+	if(m_pruned)
+		out = std::copy(m_values.begin(), m_values.end(), out);
+	else
+	{
+		for(size_t i = 0; i < m_weights.rows(); i++)
+			out = std::copy(m_weights[i].begin(), m_weights[i].end(), out);
+	}
+	std::copy(m_bias.begin(), m_bias.end(), out);
+}
+
+void Layer::setParameters(const double* in)
+{
+	if(m_pruned)
+	{
+		std::copy(in, in + m_values.size(), m_values.begin());
+		in += m_values.size();
+	}
+	else
+	{
+		for(size_t i = 0; i < m_weights.rows(); i++)
+		{
+			std::copy(in, in + m_weights.cols(), m_weights[i].begin());
+			in += m_weights.cols();
+		}
+	}
+	std::copy(in, in + m_bias.size(), m_bias.begin());
+}
+
+size_t Layer::bytes() const
+{
+	size_t doubles = m_weights.rows() * m_weights.cols() + m_bias.size() + m_net.size() + m_activation.size() + m_error.size();
+	doubles += m_values.size() + m_scatter.size();
+	size_t sparseBytes = m_row_starts.size() * sizeof(size_t) + m_columns.size() * sizeof(unsigned int);
+	size_t floats = m_weights32.size() + m_bias32.size() + m_scratch32.size();
+	return sizeof(Layer) + m_weights.rows() * sizeof(vector<double>) + doubles * sizeof(double) + sparseBytes + floats * sizeof(float);
+}
+
+
+
+
+
+
+
+
+void InferenceContext::reserve(const NeuralNet& nn)
+{
+	const std::vector<Layer*>& layers = nn.m_layers;
+	size_t widest = 0;
+	for(size_t i = 0; i + 1 < layers.size(); i++)
+		widest = std::max(widest, layers[i]->outputs());
+	for(size_t i = 0; i < 2; i++)
+	{
+		if(m_buf[i].size() < widest)
+			m_buf[i].resize(widest);
+	}
+	size_t outputs = layers[layers.size() - 1]->outputs();
+	if(m_output.size() != outputs)
+		m_output.resize(outputs);
+	if(m_input.size() < nn.m_input_shift.size())
+		m_input.resize(nn.m_input_shift.size());
+}
+
 
 
 
@@ -107,12 +572,12 @@ void Layer::update_weights(const vector<double>& in, double learning_rate)
 
 
 NeuralNet::NeuralNet(Rand& r)
-: m_rand(r)
+: m_rand(r), m_epoch_order(SHUFFLE_COPY), m_block_rows(0), m_frozen(false), m_version(0), m_mixed(false), m_mixed_version(0), m_pool(NULL), m_parallel_weights(0)
 {
 }
 
 NeuralNet::NeuralNet(const NeuralNet& other)
-: m_rand(other.m_rand)
+: m_rand(other.m_rand), m_epoch_order(other.m_epoch_order), m_block_rows(other.m_block_rows), m_input_shift(other.m_input_shift), m_input_scale(other.m_input_scale), m_frozen(false), m_version(0), m_mixed(false), m_mixed_version(0), m_pool(NULL), m_parallel_weights(0)
 {
 	throw Ex("Big objects should generally be passed by reference, not by value.");
 }
@@ -124,79 +589,1025 @@ NeuralNet::~NeuralNet()
 		delete(m_layers[i]);
 }
 
+void NeuralNet::copy(const NeuralNet& that)
+{
+	if(&that == this)
+		return;
+	for(size_t i = 0; i < m_layers.size(); i++)
+		delete(m_layers[i]);
+	m_layers.clear();
+	for(size_t i = 0; i < that.m_layers.size(); i++)
+		m_layers.push_back(that.m_layers[i]->clone());
+	m_epoch_order = that.m_epoch_order;
+	m_block_rows = that.m_block_rows;
+	m_input_shift = that.m_input_shift;
+	m_input_scale = that.m_input_scale;
+	m_frozen = that.m_frozen;
+	m_mixed = that.m_mixed;
+	m_pool = that.m_pool;
+	m_parallel_weights = that.m_parallel_weights;
+	localize();
+	m_version++;
+	m_context = InferenceContext();
+	if(m_frozen)
+	{
+		vector<double>().swap(m_normalized);
+		m_context.reserve(*this);
+	}
+	else
+		m_normalized.resize(m_input_shift.size());
+}
+
+void NeuralNet::freeze()
+{
+	for(size_t i = 0; i < m_layers.size(); i++)
+		m_layers[i]->release();
+	vector<double>().swap(m_normalized);
+	m_context.reserve(*this);
+	m_frozen = true;
+}
+
+void NeuralNet::thaw()
+{
+	for(size_t i = 0; i < m_layers.size(); i++)
+		m_layers[i]->restore();
+	m_normalized.resize(m_input_shift.size());
+	m_context = InferenceContext();
+	m_frozen = false;
+	m_mixed_version = m_version - 1; // freeze released the working copies
+}
+
+void NeuralNet::setThreadPool(ThreadPool* pPool, size_t minWeights)
+{
+	m_pool = pPool;
+	m_parallel_weights = minWeights;
+	localize();
+}
+
+void NeuralNet::check_trainable() const
+{
+	if(m_frozen)
+		throw Ex("This network is frozen. Call thaw before training it.");
+}
+
 void NeuralNet::init()
 {
 	for(size_t i = 0; i < m_layers.size(); i++)
 		m_layers[i]->init(m_rand);
+	m_version++;
+}
+
+void NeuralNet::check_pattern(size_t features, size_t labels) const
+{
+	size_t inputs = m_layers[0]->inputs();
+	size_t outputs = m_layers[m_layers.size() - 1]->outputs();
+	if(features != inputs || labels != outputs)
+		throw Ex("Expected ", to_str(inputs), " features and ", to_str(outputs), " labels, got ", to_str(features), " and ", to_str(labels));
 }
 
 void NeuralNet::refine(const std::vector<double>& feature, const std::vector<double>& label, double learning_rate)
 {
-	forward_prop(feature);
+	check_pattern(feature.size(), label.size());
+	refine(feature.data(), label.data(), learning_rate);
+}
+
+void NeuralNet::refine(const double* feature, const double* label, double learning_rate)
+{
+	check_trainable();
+	refine_pattern(normalized_input(feature), label, learning_rate);
+}
+
+void NeuralNet::refine(const SparseVector& feature, const std::vector<double>& label, double learning_rate)
+{
+	check_trainable();
+	check_sparse_input();
+	check_pattern(m_layers[0]->inputs(), label.size());
+	propagate(feature);
+	compute_output_layer_error_terms(label.data());
+	backpropagate();
+	descend_gradient(feature, learning_rate);
+}
+
+void NeuralNet::refine_pattern(const double* feature, const double* label, double learning_rate)
+{
+	if(m_mixed)
+	{
+		refine_pattern32(feature, label, learning_rate);
+		return;
+	}
+	propagate(feature);
 	compute_output_layer_error_terms(label);
 	backpropagate();
 	descend_gradient(feature, learning_rate);
 }
 
 // virtual
-void NeuralNet::train(const Matrix& features, const Matrix& labels)
+void NeuralNet::setMixedPrecision(bool enabled)
+{
+	m_mixed = enabled;
+	m_mixed_version = m_version - 1; // round the working copies before the next pattern
+	if(!enabled)
+	{
+		for(size_t i = 0; i < m_layers.size(); i++)
+			m_layers[i]->dropWorkingCopy();
+	}
+}
+
+void NeuralNet::refine_pattern32(const double* in, const double* label, double learning_rate)
+{
+	// Training keeps the working copies current, so they only need to be
+	// rounded again when something else changed the master weights
+	if(m_version != m_mixed_version)
+	{
+		for(size_t i = 0; i < m_layers.size(); i++)
+			m_layers[i]->syncWorkingCopy();
+	}
+
+	// Pruned layers have no working copy, so they use the fp64 kernels
+	NN_STATS(m_stats.addSamples(1));
+	NN_STATS_TIMER(timer);
+	for(size_t i = 0; i < m_layers.size(); i++)
+	{
+		Layer& layer = *m_layers[i];
+		const double* pIn = i == 0 ? in : m_layers[i - 1]->m_activation.data();
+		if(layer.hasWorkingCopy())
+			layer.feed_forward32(pIn);
+		else
+			layer.feed_forward(pIn);
+		NN_STATS(m_stats.addForward(i, timer.lap(), 2 * layer.weightCount()));
+	}
+	compute_output_layer_error_terms(label);
+	NN_STATS(timer.lap());
+	for(size_t i = m_layers.size() - 1; i > 0; i--)
+	{
+		if(m_layers[i]->hasWorkingCopy())
+			m_layers[i - 1]->backprop32(*m_layers[i]);
+		else
+			m_layers[i - 1]->backprop(*m_layers[i]);
+		NN_STATS(m_stats.addBackward(i - 1, timer.lap(), 2 * m_layers[i]->weightCount()));
+	}
+	descend_gradient(in, learning_rate);
+	m_mixed_version = m_version;
+}
+
+void NeuralNet::train(const MatrixView& features, const MatrixView& labels)
 {
 	if(features.rows() != labels.rows())
 		throw Ex("mismatching feature and label rows");
+	check_trainable();
 	init();
+	size_t rows = features.rows();
+	if(rows == 0)
+		return;
 
 	// Make a list of indexes
-	size_t* indexes = new size_t[features.rows()];
-	for(size_t i = 0; i < features.rows(); i++)
+	size_t* indexes = new size_t[rows];
+	NN_STATS(m_stats.addBytes(rows * sizeof(size_t)));
+	for(size_t i = 0; i < rows; i++)
 		indexes[i] = i;
 
+	// Each pattern is stored as its features followed by its label
+	size_t featureCols = features.cols();
+	size_t labelCols = labels.cols();
+	size_t stride = featureCols + labelCols;
+	vector<double> patterns;
+	if(m_epoch_order != SHUFFLE_INDEXES)
+	{
+		patterns.resize(rows * stride);
+		NN_STATS(m_stats.addBytes(rows * stride * sizeof(double)));
+	}
+	size_t blockRows = m_block_rows;
+	if(m_epoch_order == SHUFFLE_BLOCKS)
+	{
+		for(size_t i = 0; i < rows; i++)
+			copy_pattern(features[i], featureCols, labels[i], labelCols, &patterns[i * stride]);
+		if(blockRows == 0)
+			blockRows = std::max((size_t)1, (size_t)32768 / (stride * sizeof(double)));
+	}
+
 	double learning_rate = 0.1;
 	for(size_t i = 0; i < 500; i++)
 	{
-		// Shuffle the indexes
-		for(size_t j = features.rows() - 1; j > 0; j--)
-			std::swap(indexes[j], indexes[m_rand.next(j)]);
-
-		// Do one epoch of training
-		for(size_t j = 0; j < features.rows(); j++)
+		if(m_epoch_order == SHUFFLE_BLOCKS)
 		{
-			size_t index = indexes[j];
-			refine(features[index], labels[index], learning_rate);
+			shuffle_blocks(indexes, rows, blockRows);
+			for(size_t j = 0; j < rows; j++)
+			{
+				const double* pPattern = &patterns[indexes[j] * stride];
+				refine_pattern(pPattern, pPattern + featureCols, learning_rate);
+			}
+		}
+		else
+		{
+			// Shuffle the indexes
+			for(size_t j = rows - 1; j > 0; j--)
+				std::swap(indexes[j], indexes[m_rand.next(j)]);
+
+			if(m_epoch_order == SHUFFLE_COPY)
+			{
+				// Pay for the random reads once, then stream through the copy
+				for(size_t j = 0; j < rows; j++)
+					copy_pattern(features[indexes[j]], featureCols, labels[indexes[j]], labelCols, &patterns[j * stride]);
+				for(size_t j = 0; j < rows; j++)
+				{
+					const double* pPattern = &patterns[j * stride];
+					refine_pattern(pPattern, pPattern + featureCols, learning_rate);
+				}
+			}
+			else
+			{
+				for(size_t j = 0; j < rows; j++)
+				{
+					size_t index = indexes[j];
+					refine(features[index], labels[index], learning_rate);
+				}
+			}
 		}
 
 		// Decay the learning rate
 		learning_rate *= 0.997;
 	}
+	delete[] indexes;
+}
+
+void NeuralNet::copy_pattern(const double* feature, size_t featureCols, const double* label, size_t labelCols, double* pOut) const
+{
+	// Normalizing here means train() pays for it once per copy, not once per visit
+	if(m_input_shift.size() > 0)
+		normalize(feature, pOut);
+	else
+		std::copy(feature, feature + featureCols, pOut);
+	std::copy(label, label + labelCols, pOut + featureCols);
+}
+
+void NeuralNet::shuffle_blocks(size_t* indexes, size_t rows, size_t blockRows)
+{
+	// Shuffle the order of the blocks
+	size_t blockCount = (rows + blockRows - 1) / blockRows;
+	vector<size_t> blocks(blockCount);
+	for(size_t i = 0; i < blockCount; i++)
+		blocks[i] = i;
+	for(size_t i = blockCount - 1; i > 0; i--)
+		std::swap(blocks[i], blocks[m_rand.next(i + 1)]);
+
+	// Lay the blocks out in that order, and shuffle the patterns within each one
+	size_t pos = 0;
+	for(size_t i = 0; i < blockCount; i++)
+	{
+		size_t begin = blocks[i] * blockRows;
+		size_t end = std::min(rows, begin + blockRows);
+		size_t* pBlock = indexes + pos;
+		for(size_t j = begin; j < end; j++)
+			indexes[pos++] = j;
+		for(size_t j = end - begin - 1; j > 0; j--)
+			std::swap(pBlock[j], pBlock[m_rand.next(j + 1)]);
+	}
 }
 
 const std::vector<double>& NeuralNet::forward_prop(const std::vector<double>& in)
 {
+	return forward_prop(in.data());
+}
+
+const std::vector<double>& NeuralNet::forward_prop(const double* in)
+{
+	if(m_frozen)
+		return predict(in, m_context);
+	return propagate(normalized_input(in));
+}
+
+const std::vector<double>& NeuralNet::forward_prop(const SparseVector& in)
+{
+	if(m_frozen)
+		return predict(in, m_context);
+	check_sparse_input();
+	return propagate(in);
+}
+
+const std::vector<double>& NeuralNet::predict(const std::vector<double>& in, InferenceContext& ctx) const
+{
+	return predict(in.data(), ctx);
+}
+
+const std::vector<double>& NeuralNet::predict(const double* in, InferenceContext& ctx) const
+{
+	ctx.reserve(*this);
+	if(m_input_shift.size() > 0)
+	{
+		normalize(in, ctx.m_input.data());
+		in = ctx.m_input.data();
+	}
+	NN_STATS(m_stats.addSamples(1));
+	predict_layers(in, 0, m_layers.size(), ctx);
+	return ctx.m_output;
+}
+
+const std::vector<double>& NeuralNet::predict(const SparseVector& in, InferenceContext& ctx) const
+{
+	check_sparse_input();
+	ctx.reserve(*this);
+	const Layer& first = *m_layers[0];
+	if(first.m_pruned && ctx.m_scatter.size() != first.inputs())
+		ctx.m_scatter.assign(first.inputs(), 0.0);
+	NN_STATS(m_stats.addSamples(1));
+	NN_STATS_TIMER(timer);
+	double* pOut = m_layers.size() == 1 ? ctx.m_output.data() : ctx.m_buf[0].data();
+	first.compute(in, ctx.m_scatter.data(), pOut);
+	NN_STATS(m_stats.addForward(0, timer.lap(), 2 * first.outputs() * in.size()));
+	predict_layers(pOut, 1, m_layers.size(), ctx);
+	return ctx.m_output;
+}
+
+const double* NeuralNet::predict_layers(const double* in, size_t first, size_t end, InferenceContext& ctx) const
+{
+	// Hidden layers alternate between the two buffers, and the last layer writes the output
+	NN_STATS_TIMER(timer);
+	for(size_t i = first; i < end; i++)
+	{
+		double* pOut = i + 1 == m_layers.size() ? ctx.m_output.data() : ctx.m_buf[i % 2].data();
+		compute(*m_layers[i], in, pOut);
+		NN_STATS(m_stats.addForward(i, timer.lap(), 2 * m_layers[i]->weightCount()));
+		in = pOut;
+	}
+	return in;
+}
+
+void NeuralNet::check_sparse_input() const
+{
+	// Shifting the inputs would turn the zeros into non-zeros
+	if(m_input_shift.size() > 0)
+		throw Ex("Sparse inputs cannot be used with a fitted normalization");
+}
+
+const std::vector<double>& NeuralNet::propagate(const double* in)
+{
+	NN_STATS(m_stats.addSamples(1));
+	NN_STATS_TIMER(timer);
+	feed_forward(*m_layers[0], in);
+	NN_STATS(m_stats.addForward(0, timer.lap(), 2 * m_layers[0]->weightCount()));
+	return propagate_hidden();
+}
+
+const std::vector<double>& NeuralNet::propagate(const SparseVector& in)
+{
+	NN_STATS(m_stats.addSamples(1));
+	NN_STATS_TIMER(timer);
 	m_layers[0]->feed_forward(in);
+	NN_STATS(m_stats.addForward(0, timer.lap(), 2 * m_layers[0]->outputs() * in.size()));
+	return propagate_hidden();
+}
+
+const std::vector<double>& NeuralNet::propagate_hidden()
+{
+	NN_STATS_TIMER(timer);
 	for(size_t i = 1; i < m_layers.size(); i++)
-		m_layers[i]->feed_forward(m_layers[i - 1]->m_activation);
+	{
+		feed_forward(*m_layers[i], m_layers[i - 1]->m_activation.data());
+		NN_STATS(m_stats.addForward(i, timer.lap(), 2 * m_layers[i]->weightCount()));
+	}
 	return m_layers[m_layers.size() - 1]->m_activation;
 }
 
-void NeuralNet::compute_output_layer_error_terms(const std::vector<double>& target)
+// One slice of the rows of a layer for each thread of a ThreadPool
+class ForwardJob : public ThreadPool::Job
 {
+public:
+	const Layer& m_layer;
+	Layer* m_pTrainable; // if not NULL, feed forward into this layer's own buffers instead of m_out
+	const double* m_in;
+	double* m_out;
+
+	ForwardJob(const Layer& layer, Layer* pTrainable, const double* in, double* out)
+	: m_layer(layer), m_pTrainable(pTrainable), m_in(in), m_out(out)
+	{
+	}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		size_t begin, end;
+		ThreadPool::slice(m_layer.outputs(), part, parts, begin, end);
+		if(m_pTrainable)
+			m_pTrainable->feed_forward(m_in, begin, end);
+		else
+			m_layer.compute(m_in, m_out, begin, end);
+	}
+};
+
+// Moves each thread's slice of the rows of the parallel layers into memory
+// that the thread touches first, which puts it on that thread's NUMA node
+class LocalizeJob : public ThreadPool::Job
+{
+public:
+	std::vector<Layer*> m_layers;
+
+	virtual void run(size_t part, size_t parts)
+	{
+		for(size_t l = 0; l < m_layers.size(); l++)
+		{
+			size_t begin, end;
+			ThreadPool::slice(m_layers[l]->outputs(), part, parts, begin, end);
+			for(size_t i = begin; i < end; i++)
+				vector<double>(m_layers[l]->m_weights[i]).swap(m_layers[l]->m_weights[i]);
+		}
+	}
+};
+
+bool NeuralNet::parallel(const Layer& layer) const
+{
+	return m_pool && m_pool->size() > 1 && layer.weightCount() >= m_parallel_weights;
+}
+
+void NeuralNet::localize()
+{
+	// (Pruned layers keep all of their weights in one array, so they stay where they are)
+	LocalizeJob job;
+	for(size_t i = 0; i < m_layers.size(); i++)
+	{
+		if(parallel(*m_layers[i]) && !m_layers[i]->m_pruned)
+			job.m_layers.push_back(m_layers[i]);
+	}
+	if(job.m_layers.size() > 0)
+		m_pool->run(job);
+}
+
+void NeuralNet::feed_forward(Layer& layer, const double* in)
+{
+	if(!parallel(layer))
+	{
+		layer.feed_forward(in);
+		return;
+	}
+	ForwardJob job(layer, &layer, in, NULL);
+	m_pool->run(job);
+}
+
+void NeuralNet::compute(const Layer& layer, const double* in, double* out) const
+{
+	if(!parallel(layer))
+	{
+		layer.compute(in, out);
+		return;
+	}
+	ForwardJob job(layer, NULL, in, out);
+	m_pool->run(job);
+}
+
+void NeuralNet::compute_output_layer_error_terms(const double* target)
+{
+	NN_STATS_TIMER(timer);
 	Layer& output_layer = *m_layers[m_layers.size() - 1];
-	for(size_t i = 0; i < target.size(); i++)
+	for(size_t i = 0; i < output_layer.m_error.size(); i++)
 		output_layer.m_error[i] = (target[i] - output_layer.m_activation[i]) * activationDerivative(output_layer.m_net[i], output_layer.m_activation[i]);
+	NN_STATS(m_stats.addBackward(m_layers.size() - 1, timer.lap(), 3 * output_layer.m_error.size()));
 }
 
 void NeuralNet::backpropagate()
 {
+	NN_STATS_TIMER(timer);
 	for(size_t i = m_layers.size() - 1; i > 0; i--)
+	{
 		m_layers[i - 1]->backprop(*m_layers[i]);
+		NN_STATS(m_stats.addBackward(i - 1, timer.lap(), 3 * m_layers[i]->weightCount()));
+	}
+}
+
+void NeuralNet::descend_gradient(const double* in, double learning_rate)
+{
+	NN_STATS_TIMER(timer);
+	m_layers[0]->update_weights(in, learning_rate);
+	NN_STATS(m_stats.addUpdate(0, timer.lap(), 3 * (m_layers[0]->weightCount() + m_layers[0]->outputs())));
+	descend_hidden(learning_rate);
+}
+
+void NeuralNet::descend_gradient(const SparseVector& in, double learning_rate)
+{
+	NN_STATS_TIMER(timer);
+	m_layers[0]->update_weights(in, learning_rate);
+	NN_STATS(m_stats.addUpdate(0, timer.lap(), 3 * m_layers[0]->outputs() * (in.size() + 1)));
+	descend_hidden(learning_rate);
+}
+
+void NeuralNet::descend_hidden(double learning_rate)
+{
+	m_version++;
+	NN_STATS_TIMER(timer);
+	for(size_t i = 1; i < m_layers.size(); i++)
+	{
+		m_layers[i]->update_weights(m_layers[i - 1]->m_activation.data(), learning_rate);
+		NN_STATS(m_stats.addUpdate(i, timer.lap(), 3 * (m_layers[i]->weightCount() + m_layers[i]->outputs())));
+	}
+}
+
+void NeuralNet::removeUnits(size_t layer, const vector<size_t>& units)
+{
+	if(layer + 1 >= m_layers.size())
+		throw Ex("Only the units of hidden layers can be removed");
+	Layer& cur = *m_layers[layer];
+	Layer& next = *m_layers[layer + 1];
+	cur.densify();
+	next.densify();
+
+	vector<bool> drop(cur.outputs(), false);
+	for(size_t i = 0; i < units.size(); i++)
+	{
+		if(units[i] >= drop.size())
+			throw Ex("Unit ", to_str(units[i]), " is out of range");
+		drop[units[i]] = true;
+	}
+	vector<size_t> keep;
+	for(size_t i = 0; i < drop.size(); i++)
+	{
+		if(!drop[i])
+			keep.push_back(i);
+	}
+	if(keep.size() == 0)
+		throw Ex("A layer must keep at least one unit");
+
+	Layer* pCur = new Layer(cur.inputs(), keep.size());
+	Layer* pNext = new Layer(keep.size(), next.outputs());
+	for(size_t i = 0; i < keep.size(); i++)
+	{
+		pCur->m_weights[i] = cur.m_weights[keep[i]];
+		pCur->m_bias[i] = cur.m_bias[keep[i]];
+	}
+	for(size_t j = 0; j < next.outputs(); j++)
+	{
+		for(size_t i = 0; i < keep.size(); i++)
+			pNext->m_weights[j][i] = next.m_weights[j][keep[i]];
+		pNext->m_bias[j] = next.m_bias[j];
+	}
+	if(m_frozen)
+	{
+		pCur->release();
+		pNext->release();
+	}
+	delete(m_layers[layer]);
+	delete(m_layers[layer + 1]);
+	m_layers[layer] = pCur;
+	m_layers[layer + 1] = pNext;
+	localize();
+	m_version++;
+}
+
+void NeuralNet::unitScores(size_t layer, vector<double>& scores, const Matrix* pFeatures)
+{
+	if(layer + 1 >= m_layers.size())
+		throw Ex("Only the units of hidden layers can be scored");
+	Layer& next = *m_layers[layer + 1];
+	scores.assign(m_layers[layer]->outputs(), 0.0);
+	if(next.m_pruned)
+	{
+		for(size_t k = 0; k < next.m_values.size(); k++)
+			scores[next.m_columns[k]] += next.m_values[k] * next.m_values[k];
+	}
+	else
+	{
+		for(size_t j = 0; j < next.m_weights.rows(); j++)
+		{
+			for(size_t i = 0; i < scores.size(); i++)
+				scores[i] += next.m_weights[j][i] * next.m_weights[j][i];
+		}
+	}
+	for(size_t i = 0; i < scores.size(); i++)
+		scores[i] = sqrt(scores[i]);
+
+	if(pFeatures && pFeatures->rows() > 0)
+	{
+		// Only feed the features as far as this layer
+		vector<double> sumSquares(scores.size(), 0.0);
+		InferenceContext ctx(*this);
+		for(size_t r = 0; r < pFeatures->rows(); r++)
+		{
+			const double* in = (*pFeatures)[r].data();
+			if(m_input_shift.size() > 0)
+			{
+				normalize(in, ctx.m_input.data());
+				in = ctx.m_input.data();
+			}
+			const double* act = predict_layers(in, 0, layer + 1, ctx);
+			for(size_t i = 0; i < scores.size(); i++)
+				sumSquares[i] += act[i] * act[i];
+		}
+		for(size_t i = 0; i < scores.size(); i++)
+			scores[i] *= sqrt(sumSquares[i] / pFeatures->rows());
+	}
+}
+
+// Returns the indexes of the n lowest scores
+static vector<size_t> lowestScores(const vector<double>& scores, size_t n)
+{
+	vector<size_t> order(scores.size());
+	for(size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&scores](size_t a, size_t b) { return scores[a] < scores[b]; });
+	order.resize(std::min(n, order.size()));
+	return order;
+}
+
+void NeuralNet::shrinkLayer(size_t layer, size_t width, const Matrix* pFeatures)
+{
+	size_t current = m_layers[layer]->outputs();
+	if(width == 0)
+		throw Ex("A layer must keep at least one unit");
+	if(width >= current)
+		return;
+	vector<double> scores;
+	unitScores(layer, scores, pFeatures);
+	removeUnits(layer, lowestScores(scores, current - width));
+}
+
+size_t NeuralNet::shrinkWithinBudget(const Matrix& features, const Matrix& labels, double budget)
+{
+	double limit = holdout_rmse(features, labels) + budget;
+	size_t removed = 0;
+	for(size_t layer = 0; layer + 1 < m_layers.size(); layer++)
+	{
+		vector<double> scores;
+		unitScores(layer, scores, &features);
+		vector<size_t> order = lowestScores(scores, scores.size() - 1);
+
+		// Zeroing a unit's outgoing weights has the same effect on the output as
+		// removing it, so try that first and only remove the units that pass
+		m_layers[layer + 1]->densify();
+		Matrix& next = m_layers[layer + 1]->m_weights;
+		vector<size_t> accepted;
+		size_t step = std::max((size_t)1, order.size() / 16);
+		while(accepted.size() < order.size())
+		{
+			size_t end = std::min(order.size(), accepted.size() + step);
+			vector<double> saved;
+			for(size_t k = accepted.size(); k < end; k++)
+			{
+				for(size_t j = 0; j < next.rows(); j++)
+				{
+					saved.push_back(next[j][order[k]]);
+					next[j][order[k]] = 0.0;
+				}
+			}
+			if(holdout_rmse(features, labels) <= limit)
+			{
+				accepted.insert(accepted.end(), order.begin() + accepted.size(), order.begin() + end);
+				continue;
+			}
+
+			// Put the weights back, and try again with fewer units
+			size_t pos = 0;
+			for(size_t k = accepted.size(); k < end; k++)
+			{
+				for(size_t j = 0; j < next.rows(); j++)
+					next[j][order[k]] = saved[pos++];
+			}
+			if(step == 1)
+				break;
+			step = std::max((size_t)1, step / 2);
+		}
+		if(accepted.size() > 0)
+			removeUnits(layer, accepted);
+		removed += accepted.size();
+	}
+	return removed;
 }
 
-void NeuralNet::descend_gradient(const vector<double>& in, double learning_rate)
+double NeuralNet::holdout_rmse(const Matrix& features, const Matrix& labels)
+{
+	return evaluate(features, labels).rmse;
+}
+
+// Returns the index of the largest of n values
+static size_t indexOfMax(const double* values, size_t n)
+{
+	size_t best = 0;
+	for(size_t i = 1; i < n; i++)
+	{
+		if(values[i] > values[best])
+			best = i;
+	}
+	return best;
+}
+
+// Sums the errors of one range of rows for each thread of a ThreadPool
+class EvaluateJob : public ThreadPool::Job
+{
+public:
+	const NeuralNet& m_nn;
+	const MatrixView& m_features;
+	const MatrixView& m_labels;
+	double m_threshold; // splits the classes of a single output
+	vector<double> m_sse; // per part
+	vector<double> m_sae;
+	vector<size_t> m_correct;
+
+	EvaluateJob(const NeuralNet& nn, const MatrixView& features, const MatrixView& labels, double threshold, size_t parts)
+	: m_nn(nn), m_features(features), m_labels(labels), m_threshold(threshold), m_sse(parts, 0.0), m_sae(parts, 0.0), m_correct(parts, 0)
+	{
+	}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		InferenceContext ctx(m_nn);
+		size_t rows = m_features.rows();
+		size_t outs = m_labels.cols();
+		double sse = 0.0;
+		double sae = 0.0;
+		size_t correct = 0;
+		for(size_t i = rows * part / parts; i < rows * (part + 1) / parts; i++)
+		{
+			const double* pPrediction = m_nn.predict(m_features[i], ctx).data();
+			const double* pLabel = m_labels[i];
+			for(size_t j = 0; j < outs; j++)
+			{
+				double err = pLabel[j] - pPrediction[j];
+				sse += err * err;
+				sae += std::abs(err);
+			}
+			if(outs == 1)
+			{
+				if((pPrediction[0] >= m_threshold) == (pLabel[0] >= m_threshold))
+					correct++;
+			}
+			else if(indexOfMax(pPrediction, outs) == indexOfMax(pLabel, outs))
+				correct++;
+		}
+		m_sse[part] = sse;
+		m_sae[part] = sae;
+		m_correct[part] = correct;
+	}
+};
+
+Evaluation NeuralNet::evaluate(const MatrixView& features, const MatrixView& labels) const
 {
-	const vector<double>* pActivation = &in;
+	if(features.rows() != labels.rows())
+		throw Ex("mismatching feature and label rows");
+	if(m_layers.size() == 0 || features.cols() != m_layers[0]->inputs() || labels.cols() != m_layers[m_layers.size() - 1]->outputs())
+		throw Ex("The data does not fit the network's inputs and outputs");
+	Evaluation result;
+	size_t rows = features.rows();
+	if(rows == 0)
+		return result;
+
+	double threshold = 0.0;
+	if(labels.cols() == 1)
+	{
+		double lo = labels[0][0];
+		double hi = lo;
+		for(size_t i = 1; i < rows; i++)
+		{
+			lo = std::min(lo, labels[i][0]);
+			hi = std::max(hi, labels[i][0]);
+		}
+		threshold = 0.5 * (lo + hi);
+	}
+
+	// Only split the work when there is enough of it to pay for the handoff
+	size_t weights = 0;
 	for(size_t i = 0; i < m_layers.size(); i++)
+		weights += m_layers[i]->weightCount();
+	ThreadPool* pPool = rows * weights >= 1000000 ? &ThreadPool::shared() : NULL;
+	size_t parts = pPool && rows >= pPool->size() ? pPool->size() : 1;
+	EvaluateJob job(*this, features, labels, threshold, parts);
+	if(parts > 1)
+		pPool->run(job);
+	else
+		job.run(0, 1);
+
+	size_t correct = 0;
+	for(size_t p = 0; p < parts; p++)
+	{
+		result.sse += job.m_sse[p];
+		result.mae += job.m_sae[p];
+		correct += job.m_correct[p];
+	}
+	size_t count = rows * labels.cols();
+	result.rows = rows;
+	result.rmse = sqrt(result.sse / count);
+	result.mae /= count;
+	result.accuracy = (double)correct / rows;
+	return result;
+}
+
+void NeuralNet::fitNormalization(const MatrixView& features)
+{
+	vector<ColumnStats> stats;
+	features.columnStats(stats, false); // (only the means and variances are needed)
+	m_input_shift.resize(stats.size());
+	m_input_scale.resize(stats.size());
+	for(size_t i = 0; i < stats.size(); i++)
 	{
-		m_layers[i]->update_weights(*pActivation, learning_rate);
-		pActivation = &m_layers[i]->m_activation;
+		double dev = sqrt(stats[i].variance);
+		m_input_shift[i] = stats[i].mean;
+		m_input_scale[i] = dev > 1e-12 ? 1.0 / dev : 1.0;
 	}
+	m_normalized.resize(stats.size());
+	m_version++;
 }
 
+void NeuralNet::clearNormalization()
+{
+	m_input_shift.clear();
+	m_input_scale.clear();
+	m_normalized.clear();
+	m_version++;
+}
+
+void NeuralNet::normalize(const double* in, double* out) const
+{
+	// A branch-free loop over contiguous arrays, so the compiler can vectorize it
+	const double* pShift = m_input_shift.data();
+	const double* pScale = m_input_scale.data();
+	size_t n = m_input_shift.size();
+	for(size_t i = 0; i < n; i++)
+	{
+		double x = (in[i] - pShift[i]) * pScale[i];
+		out[i] = in[i] == UNKNOWN_VALUE ? 0.0 : x;
+	}
+}
+
+const double* NeuralNet::normalized_input(const double* in)
+{
+	if(m_input_shift.size() == 0)
+		return in;
+	normalize(in, m_normalized.data());
+	return m_normalized.data();
+}
+
+size_t NeuralNet::prune(double threshold)
+{
+	size_t kept = 0;
+	for(size_t i = 0; i < m_layers.size(); i++)
+		kept += m_layers[i]->prune(threshold);
+	m_version++;
+	return kept;
+}
+
+size_t NeuralNet::pruneToSparsity(double sparsity)
+{
+	size_t kept = 0;
+	for(size_t i = 0; i < m_layers.size(); i++)
+		kept += m_layers[i]->pruneToSparsity(sparsity);
+	m_version++;
+	return kept;
+}
+
+size_t NeuralNet::parameterCount() const
+{
+	size_t count = 0;
+	for(size_t i = 0; i < m_layers.size(); i++)
+		count += m_layers[i]->parameterCount();
+	return count;
+}
+
+void NeuralNet::getParameters(double* out) const
+{
+	for(size_t i = 0; i < m_layers.size(); i++)
+	{
+		m_layers[i]->getParameters(out);
+		out += m_layers[i]->parameterCount();
+	}
+}
+
+void NeuralNet::setParameters(const double* in)
+{
+	for(size_t i = 0; i < m_layers.size(); i++)
+	{
+		m_layers[i]->setParameters(in);
+		in += m_layers[i]->parameterCount();
+	}
+	m_version++;
+}
+
+NetStats NeuralNet::stats() const
+{
+	NetStats s = m_stats.snapshot(m_layers.size());
+	for(size_t i = 0; i < m_layers.size(); i++)
+	{
+		s.model_bytes += m_layers[i]->bytes();
+		s.layers[i].threads = parallel(*m_layers[i]) ? m_pool->size() : 1;
+	}
+	return s;
+}
+
+void NeuralNet::save(std::string filename) const
+{
+	std::ofstream s;
+	s.exceptions(std::ios::failbit|std::ios::badbit);
+	try
+	{
+		s.open(filename.c_str(), std::ios::binary);
+	}
+	catch(const std::exception&)
+	{
+		throw Ex("Error creating file: ", filename);
+	}
+	Layer* pLayer = NULL;
+	try
+	{
+		s.precision(17);
+		s << "NEURALNET 1\n";
+		s << "LAYERS " << m_layers.size() << "\n";
+		for(size_t i = 0; i < m_layers.size(); i++)
+		{
+			pLayer = m_layers[i]->clone();
+			pLayer->densify();
+			s << "LAYER " << pLayer->inputs() << " " << pLayer->outputs() << (m_layers[i]->m_pruned ? " PRUNED" : "") << "\n";
+			for(size_t j = 0; j < pLayer->outputs(); j++)
+			{
+				for(size_t k = 0; k < pLayer->inputs(); k++)
+					s << pLayer->m_weights[j][k] << " ";
+				s << pLayer->m_bias[j] << "\n";
+			}
+			delete(pLayer);
+			pLayer = NULL;
+		}
+		s << "NORMALIZATION " << m_input_shift.size() << "\n";
+		for(size_t i = 0; i < m_input_shift.size(); i++)
+			s << m_input_shift[i] << " " << m_input_scale[i] << "\n";
+		s.close(); // (so a failure to flush the last block is reported too)
+	}
+	catch(const std::exception&)
+	{
+		delete(pLayer);
+		throw Ex("Error writing file: ", filename);
+	}
+}
+
+void NeuralNet::load(std::string filename)
+{
+	std::ifstream s(filename.c_str());
+	if(!s)
+		throw Ex("failed to open the file: ", filename);
+	std::string tag;
+	size_t version, layerCount;
+	s >> tag >> version;
+	if(!s || tag != "NEURALNET" || version != 1)
+		throw Ex("Not a neural network file: ", filename);
+	s >> tag >> layerCount;
+	if(!s || tag != "LAYERS" || layerCount == 0)
+		throw Ex("Expected a layer count in ", filename);
+
+	vector<Layer*> layers;
+	vector<double> shift, scale;
+	try
+	{
+		for(size_t i = 0; i < layerCount; i++)
+		{
+			size_t inputs, outputs;
+			s >> tag >> inputs >> outputs;
+			std::string rest;
+			std::getline(s, rest);
+			if(!s || tag != "LAYER" || inputs == 0 || outputs == 0)
+				throw Ex("Bad layer header in ", filename);
+			if(inputs > NN_MAX_LAYER_WEIGHTS / outputs)
+				throw Ex("Layer ", to_str(i), " is too big in ", filename);
+			if(i > 0 && inputs != layers[i - 1]->outputs())
+				throw Ex("Layer ", to_str(i), " does not fit the layer before it in ", filename);
+			bool pruned = rest.find("PRUNED") != std::string::npos;
+			layers.push_back(new Layer(inputs, outputs));
+			Layer& layer = *layers[i];
+			for(size_t j = 0; j < outputs; j++)
+			{
+				for(size_t k = 0; k < inputs; k++)
+					s >> layer.m_weights[j][k];
+				s >> layer.m_bias[j];
+			}
+			if(!s)
+				throw Ex("Missing weights in ", filename);
+			if(pruned)
+				layer.prune(0.0); // (keeps every weight that is not zero)
+		}
+		size_t normalized;
+		s >> tag >> normalized;
+		if(!s || tag != "NORMALIZATION" || (normalized != 0 && normalized != layers[0]->inputs()))
+			throw Ex("Bad input normalization in ", filename);
+		shift.resize(normalized);
+		scale.resize(normalized);
+		for(size_t i = 0; i < normalized; i++)
+			s >> shift[i] >> scale[i];
+		if(!s)
+			throw Ex("Missing input normalization in ", filename);
+	}
+	catch(const Ex&)
+	{
+		for(size_t i = 0; i < layers.size(); i++)
+			delete(layers[i]);
+		throw;
+	}
+	catch(const std::exception&)
+	{
+		// (Such as bad_alloc, when the file asks for more memory than there is)
+		for(size_t i = 0; i < layers.size(); i++)
+			delete(layers[i]);
+		throw Ex("Not enough memory for the layers in ", filename);
+	}
+
+	for(size_t i = 0; i < m_layers.size(); i++)
+		delete(m_layers[i]);
+	m_layers.swap(layers);
+	m_input_shift.swap(shift);
+	m_input_scale.swap(scale);
+	localize();
+	m_version++;
+	if(m_frozen)
+		freeze();
+	else
+		m_normalized.resize(m_input_shift.size());
+}
@@ -7,30 +7,190 @@
 #define NEURALNET_H
 
 #include <vector>
+#include <string>
+#include <math.h>
 #include "matrix.h"
+#include "stats.h"
 
 class Rand;
+class NeuralNet;
+class ThreadPool;
+
+/// NeuralNet::load rejects files with a layer of more weights than this
+#define NN_MAX_LAYER_WEIGHTS ((size_t)1 << 31)
+
+
+/// The activation function of every unit. (It is inline so that FixedNet
+/// computes exactly the same values without a call.)
+inline double activation(double x)
+{
+	if(x >= 700.0) // Don't trigger a floating point exception
+		return 1.0;
+	if(x < -700.0) // Don't trigger a floating point exception
+		return -1.0;
+	return tanh(x);
+}
 
 
 /// An class used by the NeuralNet class
 class Layer
 {
 public:
-	Matrix m_weights; // cols = in, rows = out
+	Matrix m_weights; // cols = in, rows = out (no rows once the layer is pruned)
 	std::vector<double> m_bias;
 	std::vector<double> m_net;
 	std::vector<double> m_activation;
 	std::vector<double> m_error;
 
+	// Once the layer is pruned, the surviving weights are kept in compressed sparse row form
+	bool m_pruned;
+	std::vector<size_t> m_row_starts; // outputs + 1 offsets into m_columns and m_values
+	std::vector<unsigned int> m_columns;
+	std::vector<double> m_values;
+	std::vector<double> m_scatter; // zeros, used to feed sparse inputs through pruned weights
+
+	// The fp32 working copy used by mixed-precision training (empty otherwise)
+	std::vector<float> m_weights32; // outputs rows of inputs values
+	std::vector<float> m_bias32;
+	std::vector<float> m_scratch32; // one input or error vector, rounded to fp32
+
 	Layer(size_t inputs, size_t outputs);
 
+	size_t inputs() const { return m_weights.cols(); }
+	size_t outputs() const { return m_bias.size(); }
+
+	/// Returns the number of stored weights (inputs * outputs, unless the layer is pruned)
+	size_t weightCount() const;
+
+	/// Returns the number of stored weights plus the number of biases
+	size_t parameterCount() const { return weightCount() + outputs(); }
+
+	/// Copies the stored weights, then the biases, into out
+	void getParameters(double* out) const;
+
+	/// Sets the stored weights and biases from values laid out like getParameters
+	void setParameters(const double* in);
+
 	void init(Rand& rand);
-	void feed_forward(const std::vector<double>& in);
+	void feed_forward(const double* in);
+	void feed_forward(const SparseVector& in); // only visits the non-zero inputs
+
+	/// Computes only outputs [begin, end). Threads may call this at once
+	/// for ranges that do not overlap.
+	void feed_forward(const double* in, size_t begin, size_t end);
+
+	/// Computes the activations for in without touching m_net or m_activation,
+	/// so any number of threads may call it at once
+	void compute(const double* in, double* out) const;
+	void compute(const SparseVector& in, double* scatter, double* out) const;
+	void compute(const double* in, double* out, size_t begin, size_t end) const; // only outputs [begin, end)
 	void backprop(const Layer& from);
-	void update_weights(const std::vector<double>& alpha, double learning_rate);
+
+	/// Rounds the weights into the fp32 working copy. (Pruned layers have
+	/// none.) After this, update_weights keeps the copy current.
+	void syncWorkingCopy();
+
+	/// Frees the fp32 working copy
+	void dropWorkingCopy();
+
+	/// Returns true if feed_forward32 and backprop32 can use the working copy
+	bool hasWorkingCopy() const { return !m_pruned && m_bias32.size() == m_bias.size(); }
+
+	/// Like feed_forward and backprop, but the products are computed in fp32
+	/// from the working copy. m_net, m_activation and m_error are still
+	/// doubles, so update_weights adjusts the fp64 master weights.
+	void feed_forward32(const double* in);
+	void backprop32(const Layer& from);
+
+	void update_weights(const double* in, double learning_rate);
+	void update_weights(const SparseVector& in, double learning_rate); // only touches the columns of non-zero inputs
+
+	/// Removes every weight whose magnitude is below threshold, and switches the
+	/// layer to sparse storage. The removed weights stay at zero through any
+	/// later training. Returns the number of weights that are left.
+	size_t prune(double threshold);
+
+	/// Prunes the smallest weights until the specified fraction of them are zero.
+	/// Returns the number of weights that are left.
+	size_t pruneToSparsity(double sparsity);
+
+	/// Switches a pruned layer back to dense storage. (The pruned weights become ordinary zeros.)
+	void densify();
+
+	/// Returns a deep copy of this layer
+	Layer* clone() const;
+
+	/// Releases m_net, m_activation, m_error, and m_scatter. After this, the
+	/// layer can only be used through compute.
+	void release();
+
+	/// Allocates the buffers that release frees
+	void restore();
+
+	/// Returns the number of bytes held by this layer
+	size_t bytes() const;
+
+protected:
+	void feed_forward_pruned(const double* in, size_t begin, size_t end);
+	void scatter(const SparseVector& in);
+	void unscatter(const SparseVector& in);
+};
+
+
+
+
+/// Scratch space for NeuralNet::predict. Each thread that makes predictions
+/// needs a context of its own, but any number of contexts can share one
+/// NeuralNet, with no locking.
+class InferenceContext
+{
+public:
+	std::vector<double> m_buf[2]; // ping-pong activations, each as big as the widest hidden layer
+	std::vector<double> m_input; // the normalized input
+	std::vector<double> m_scatter; // zeros, used to feed sparse inputs through pruned weights
+	std::vector<double> m_output;
+
+	InferenceContext() {}
+
+	/// Makes a context that is already big enough for nn
+	InferenceContext(const NeuralNet& nn) { reserve(nn); }
+
+	/// Grows the buffers if they are too small for nn. (This only
+	/// allocates the first time a context is used with a network.)
+	void reserve(const NeuralNet& nn);
 };
 
 
+/// How NeuralNet::train orders the patterns in each epoch
+enum EpochOrder
+{
+	/// Shuffle an array of row indexes, and visit the rows of the
+	/// features and labels in that order
+	SHUFFLE_INDEXES,
+
+	/// Gather the patterns into one contiguous buffer in shuffled order at
+	/// the start of each epoch, then stream through it. This visits the
+	/// patterns in exactly the same order as SHUFFLE_INDEXES.
+	SHUFFLE_COPY,
+
+	/// Copy the patterns into a contiguous buffer once, then in each epoch
+	/// visit contiguous blocks in shuffled order, shuffling the patterns
+	/// within each block. Every access stays inside a cache-sized block.
+	SHUFFLE_BLOCKS,
+};
+
+
+/// The error of a NeuralNet over a labeled data set
+struct Evaluation
+{
+	size_t rows;
+	double sse; // the sum of the squared errors of every output
+	double rmse; // over every output of every row
+	double mae; // the mean absolute error of every output
+	double accuracy; // the fraction of rows whose predicted class is right (see NeuralNet::evaluate)
+
+	Evaluation() : rows(0), sse(0.0), rmse(0.0), mae(0.0), accuracy(0.0) {}
+};
 
 
 /// A multi-layer perceptron neural network
@@ -39,28 +199,183 @@ class NeuralNet
 public:
 	Rand& m_rand;
 	std::vector<Layer*> m_layers;
+	mutable StatsCollector m_stats; // safe to update from const methods, because each thread has its own shard
+	EpochOrder m_epoch_order; // defaults to SHUFFLE_COPY
+	size_t m_block_rows; // patterns per block for SHUFFLE_BLOCKS (0 picks about 32KB worth)
+	std::vector<double> m_input_shift; // the fitted input normalization (empty when inputs are used as-is)
+	std::vector<double> m_input_scale;
+	std::vector<double> m_normalized; // scratch space for one normalized input vector
+	bool m_frozen;
+	InferenceContext m_context; // used by forward_prop once the network is frozen
+	uint64_t m_version; // bumped whenever anything that affects predictions changes
+	bool m_mixed; // train through fp32 working copies of the weights
+	uint64_t m_mixed_version; // m_version right after the last mixed-precision step
+	ThreadPool* m_pool; // splits the forward pass of big layers across threads (not owned, may be NULL)
+	size_t m_parallel_weights; // the fewest weights a layer needs to use m_pool
 
 
 	NeuralNet(Rand& r);
 	NeuralNet(const NeuralNet& other);
 	virtual ~NeuralNet();
 
+	/// Makes this network a deep copy of that one (but keeps its own Rand)
+	void copy(const NeuralNet& that);
+
+	/// Switches to an inference-only mode that releases all of the per-layer
+	/// state that training needs. After this, forward_prop runs through two
+	/// ping-pong buffers sized to the widest layer, and refine and train throw.
+	void freeze();
+
+	/// Goes back to a trainable network
+	void thaw();
+
+	bool isFrozen() const { return m_frozen; }
+
+	/// Runs the forward and backward passes of refine and train (on dense
+	/// inputs) in fp32, from a working copy of the weights. Weight updates
+	/// still accumulate in the fp64 master weights, and each updated weight
+	/// is rounded into the working copy as it is written.
+	void setMixedPrecision(bool enabled);
+
+	bool isMixedPrecision() const { return m_mixed; }
+
+	/// Splits the rows of each layer with at least minWeights weights across
+	/// the threads of pPool, for the forward passes of forward_prop, predict
+	/// and refine. The results are identical to the serial ones. Each thread's
+	/// rows are reallocated by that thread, so with a pinned pool they live on
+	/// its NUMA node. (This is redone whenever layers are replaced.) The pool
+	/// is not owned, and must outlive this network and every copy of it. (NULL
+	/// goes back to one thread.)
+	void setThreadPool(ThreadPool* pPool, size_t minWeights);
+
+	/// Returns the number of weights and biases in all layers
+	size_t parameterCount() const;
+
+	/// Copies every layer's parameters into out, one layer after another
+	void getParameters(double* out) const;
+
+	/// Sets every layer's parameters from values laid out like getParameters
+	void setParameters(const double* in);
+
+	/// Returns a number that changes whenever the weights or the input
+	/// normalization change, so callers can tell when cached predictions are stale
+	uint64_t version() const { return m_version; }
+
 	/// Initializes each layer with small random values
 	void init();
 
-	/// Present one pattern to refine this NeuralNet
+	/// Present one pattern to refine this NeuralNet. (The vector overload
+	/// throws if the sizes do not match the network. The pointer overload
+	/// trusts the caller.)
 	void refine(const std::vector<double>& feature, const std::vector<double>& label, double learning_rate);
+	void refine(const double* feature, const double* label, double learning_rate);
+
+	/// Present one pattern with sparse features. The first layer only computes over,
+	/// and only updates the weights of, the non-zero inputs.
+	void refine(const SparseVector& feature, const std::vector<double>& label, double learning_rate);
 
 	/// Train the NeuralNet
-	void train(const Matrix& features, const Matrix& labels);
+	void train(const MatrixView& features, const MatrixView& labels);
 
 	/// Feed an input vector through this neural network to compute a predicted output vector
 	const std::vector<double>& forward_prop(const std::vector<double>& in);
+	const std::vector<double>& forward_prop(const double* in);
+	const std::vector<double>& forward_prop(const SparseVector& in);
+
+	/// Prunes every weight whose magnitude is below threshold. The pruned layers
+	/// switch to sparse storage, and refine keeps the pruned weights at zero,
+	/// so it can be used to fine-tune afterward. Returns the number of weights left.
+	size_t prune(double threshold);
+
+	/// Prunes the smallest weights in each layer until the specified fraction
+	/// (0.9, for example) of them are zero. Returns the number of weights left.
+	size_t pruneToSparsity(double sparsity);
+
+	/// Removes the specified units from hidden layer "layer". This drops their
+	/// rows of weights and biases, and the matching columns of the next layer's
+	/// weights, leaving a smaller dense network. (If either layer was pruned,
+	/// it is made dense again first.)
+	void removeUnits(size_t layer, const std::vector<size_t>& units);
+
+	/// Scores each unit in hidden layer "layer" by the norm of its outgoing
+	/// weights. If pFeatures is given, each score is also scaled by the RMS
+	/// activation of the unit over those features. Low scores mean the unit
+	/// contributes little to the output.
+	void unitScores(size_t layer, std::vector<double>& scores, const Matrix* pFeatures = NULL);
+
+	/// Removes the lowest-scoring units from hidden layer "layer" until it has
+	/// the specified width
+	void shrinkLayer(size_t layer, size_t width, const Matrix* pFeatures = NULL);
+
+	/// Greedily removes the lowest-scoring hidden units for as long as the
+	/// root-mean-squared error over the held-out features and labels stays
+	/// within "budget" of what it was to begin with. Returns the number of
+	/// units that were removed.
+	size_t shrinkWithinBudget(const Matrix& features, const Matrix& labels, double budget);
+
+	/// Fits a z-score normalization to the columns of features. From then on, every
+	/// input presented to refine, train, or forward_prop is normalized the same way.
+	void fitNormalization(const MatrixView& features);
+
+	/// Goes back to using the inputs as-is
+	void clearNormalization();
+
+	/// Applies the fitted normalization to one input vector. (Unknown values become 0, the mean.)
+	void normalize(const double* in, double* out) const;
+
+	/// Computes a prediction using only the scratch space in ctx. This does not
+	/// modify the network, so many threads can predict with one NeuralNet at
+	/// the same time, as long as none of them refines or trains it meanwhile.
+	const std::vector<double>& predict(const double* in, InferenceContext& ctx) const;
+	const std::vector<double>& predict(const std::vector<double>& in, InferenceContext& ctx) const;
+	const std::vector<double>& predict(const SparseVector& in, InferenceContext& ctx) const;
+
+	/// Predicts every row of features and measures the error against labels.
+	/// Big data sets are split across the shared ThreadPool, with each thread
+	/// summing its own rows. For accuracy, the class of a row with several
+	/// outputs is the index of the largest one. With one output, values at or
+	/// above the midpoint of the labels' range are one class, and values below
+	/// it the other. Like predict, this does not modify the network.
+	Evaluation evaluate(const MatrixView& features, const MatrixView& labels) const;
+
+	/// Returns the counters collected so far. (They are all zero unless the
+	/// extension was compiled with NN_ENABLE_STATS.)
+	NetStats stats() const;
+
+	/// Writes the topology, the weights, and the input normalization to a
+	/// text file. Values are written with 17 significant digits, so load
+	/// restores them exactly. Pruned layers are written densely, with zeros
+	/// for the pruned weights, and load prunes them again, so they stay at
+	/// zero through later training. (A surviving weight that was trained to
+	/// exactly zero comes back pruned.)
+	void save(std::string filename) const;
+
+	/// Replaces this network with one that was written by save
+	void load(std::string filename);
 
 protected:
-	void compute_output_layer_error_terms(const std::vector<double>& target);
+	double holdout_rmse(const Matrix& features, const Matrix& labels);
+	const double* normalized_input(const double* in);
+	const double* predict_layers(const double* in, size_t first, size_t end, InferenceContext& ctx) const;
+	void check_trainable() const;
+	void check_pattern(size_t features, size_t labels) const;
+	void refine_pattern(const double* in, const double* label, double learning_rate);
+	const std::vector<double>& propagate(const double* in);
+	const std::vector<double>& propagate(const SparseVector& in);
+	const std::vector<double>& propagate_hidden();
+	bool parallel(const Layer& layer) const;
+	void localize();
+	void feed_forward(Layer& layer, const double* in);
+	void compute(const Layer& layer, const double* in, double* out) const;
+	void refine_pattern32(const double* in, const double* label, double learning_rate);
+	void check_sparse_input() const;
+	void compute_output_layer_error_terms(const double* target);
 	void backpropagate();
-	void descend_gradient(const std::vector<double>& in, double learning_rate);
+	void descend_gradient(const double* in, double learning_rate);
+	void descend_gradient(const SparseVector& in, double learning_rate);
+	void descend_hidden(double learning_rate);
+	void copy_pattern(const double* feature, size_t featureCols, const double* label, size_t labelCols, double* pOut) const;
+	void shuffle_blocks(size_t* indexes, size_t rows, size_t blockRows);
 };
 
 
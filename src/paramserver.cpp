@@ -0,0 +1,217 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "paramserver.h"
+#include "neuralnet.h"
+#include "matrix.h"
+#include "rand.h"
+#include "error.h"
+#include "string.h"
+#include <atomic>
+#include <new>
+#include <algorithm>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+using std::vector;
+
+
+// Lives at the start of the shared memory, followed by the parameters. A
+// robust process-shared mutex lets the survivors carry on when a worker
+// dies while it holds the lock.
+struct ProcessTrainer::Segment
+{
+	pthread_mutex_t mutex;
+	std::atomic<uint64_t> version; // the number of pushes applied so far
+};
+
+
+ProcessTrainer::ProcessTrainer(const ProcessTrainerOptions& options)
+: m_options(options), m_pSegment(NULL), m_pParams(NULL), m_bytes(0), m_failed(0)
+{
+	if(m_options.workers == 0)
+		throw Ex("Expected at least one worker");
+	m_options.batch_size = std::max((size_t)1, m_options.batch_size);
+}
+
+ProcessTrainer::~ProcessTrainer()
+{
+	release();
+}
+
+void ProcessTrainer::allocate(size_t parameters)
+{
+	release();
+	size_t header = (sizeof(Segment) + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+	m_bytes = header + parameters * sizeof(double);
+	void* pMem = mmap(NULL, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(pMem == MAP_FAILED)
+		throw Ex("Could not map ", to_str(m_bytes), " bytes of shared memory");
+	m_pSegment = new (pMem) Segment();
+	m_pParams = (double*)((char*)pMem + header);
+	m_pSegment->version.store(0);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	int err = pthread_mutex_init(&m_pSegment->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if(err != 0)
+	{
+		release();
+		throw Ex("Could not create a process-shared mutex");
+	}
+}
+
+void ProcessTrainer::release()
+{
+	if(!m_pSegment)
+		return;
+	pthread_mutex_destroy(&m_pSegment->mutex);
+	m_pSegment->~Segment();
+	munmap(m_pSegment, m_bytes);
+	m_pSegment = NULL;
+	m_pParams = NULL;
+}
+
+uint64_t ProcessTrainer::updates() const
+{
+	return m_pSegment ? m_pSegment->version.load() : 0;
+}
+
+void ProcessTrainer::lock()
+{
+	if(pthread_mutex_lock(&m_pSegment->mutex) == EOWNERDEAD)
+	{
+		// A worker died in the middle of a push. Its half-added delta
+		// stays, which is no worse than a slightly noisy gradient step.
+		pthread_mutex_consistent(&m_pSegment->mutex);
+	}
+}
+
+void ProcessTrainer::unlock()
+{
+	pthread_mutex_unlock(&m_pSegment->mutex);
+}
+
+void ProcessTrainer::push(const double* local, const double* base, size_t count)
+{
+	lock();
+	for(size_t i = 0; i < count; i++)
+		m_pParams[i] += local[i] - base[i];
+	m_pSegment->version++;
+	unlock();
+}
+
+uint64_t ProcessTrainer::pull(double* local, size_t count)
+{
+	lock();
+	std::copy(m_pParams, m_pParams + count, local);
+	uint64_t version = m_pSegment->version.load();
+	unlock();
+	return version;
+}
+
+size_t ProcessTrainer::train(NeuralNet& nn, const MatrixView& features, const MatrixView& labels)
+{
+	if(features.rows() != labels.rows())
+		throw Ex("mismatching feature and label rows");
+	if(nn.isFrozen())
+		throw Ex("This network is frozen. Call thaw before training it.");
+	size_t count = nn.parameterCount();
+	allocate(count);
+	nn.getParameters(m_pParams);
+
+	// Each worker gets a copy-on-write image of this process, including nn
+	vector<pid_t> pids;
+	for(size_t w = 0; w < m_options.workers; w++)
+	{
+		pid_t pid = fork();
+		if(pid == 0)
+		{
+			int status = 0;
+			try
+			{
+				work(nn, features, labels, w);
+			}
+			catch(...)
+			{
+				status = 1;
+			}
+			_exit(status); // never return into the caller's code in a child
+		}
+		if(pid > 0)
+			pids.push_back(pid);
+	}
+	m_failed = m_options.workers - pids.size();
+	for(size_t i = 0; i < pids.size(); i++)
+	{
+		int status;
+		while(waitpid(pids[i], &status, 0) < 0 && errno == EINTR)
+		{
+		}
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			m_failed++;
+	}
+	if(m_failed == m_options.workers)
+		throw Ex("Every training process failed");
+
+	nn.setParameters(m_pParams);
+	return m_failed;
+}
+
+void ProcessTrainer::work(NeuralNet& nn, const MatrixView& features, const MatrixView& labels, size_t worker)
+{
+	// This worker's shard is every workers-th pattern
+	vector<size_t> shard;
+	for(size_t i = worker; i < features.rows(); i += m_options.workers)
+		shard.push_back(i);
+	if(shard.size() == 0)
+		return;
+
+	Rand rand = nn.m_rand.split(worker + 1);
+	size_t count = nn.parameterCount();
+	vector<double> local(count);
+	vector<double> base(count);
+	uint64_t pulled = pull(base.data(), count);
+	nn.setParameters(base.data());
+	uint64_t pushed = 0; // pushes of our own since the last pull
+
+	double learning_rate = m_options.learning_rate;
+	size_t inBatch = 0;
+	for(size_t epoch = 0; epoch < m_options.epochs; epoch++)
+	{
+		for(size_t j = shard.size() - 1; j > 0; j--)
+			std::swap(shard[j], shard[rand.next(j + 1)]);
+		for(size_t j = 0; j < shard.size(); j++)
+		{
+			nn.refine(features[shard[j]], labels[shard[j]], learning_rate);
+			if(++inBatch < m_options.batch_size && !(epoch + 1 == m_options.epochs && j + 1 == shard.size()))
+				continue;
+
+			// Push what this batch changed. Our own change is already in
+			// the local weights, so it becomes the new base.
+			inBatch = 0;
+			nn.getParameters(local.data());
+			push(local.data(), base.data(), count);
+			pushed++;
+			base.swap(local);
+
+			// Pull once we have missed too many of the other workers' updates
+			if(m_pSegment->version.load() - pulled - pushed > m_options.staleness)
+			{
+				pulled = pull(base.data(), count);
+				pushed = 0;
+				nn.setParameters(base.data());
+			}
+		}
+		learning_rate *= 0.997;
+	}
+}
@@ -0,0 +1,71 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef PARAMSERVER_H
+#define PARAMSERVER_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class NeuralNet;
+class MatrixView;
+
+
+/// Settings for ProcessTrainer
+struct ProcessTrainerOptions
+{
+	size_t workers; // the number of worker processes
+	size_t epochs; // passes each worker makes over its shard
+	double learning_rate; // decays by 0.997 per epoch, like NeuralNet::train
+	size_t batch_size; // patterns a worker trains on before it pushes its changes
+	size_t staleness; // the most updates from other workers a worker may miss before it pulls
+
+	ProcessTrainerOptions() : workers(4), epochs(100), learning_rate(0.1), batch_size(32), staleness(4) {}
+};
+
+
+/// Trains one NeuralNet with several worker processes on one machine. The
+/// parameters live in a shared memory segment (the parameter server). Each
+/// worker is forked with a copy of the network, trains on its own shard of
+/// the patterns, and after every mini-batch adds the change in its weights
+/// to the shared parameters. Once it has missed more than the staleness
+/// bound of other workers' updates, it pulls the shared parameters before
+/// training further. A worker that crashes only loses its unpushed batch.
+class ProcessTrainer
+{
+protected:
+	struct Segment; // the header at the start of the shared memory
+
+	ProcessTrainerOptions m_options;
+	Segment* m_pSegment;
+	double* m_pParams; // the shared parameters, right after the header
+	size_t m_bytes;
+	size_t m_failed;
+
+public:
+	ProcessTrainer(const ProcessTrainerOptions& options = ProcessTrainerOptions());
+	~ProcessTrainer();
+
+	/// Trains nn on the patterns, then copies the shared parameters back into
+	/// it. Returns the number of workers that did not finish. (Throws if
+	/// every worker failed, or if no worker could be started.)
+	size_t train(NeuralNet& nn, const MatrixView& features, const MatrixView& labels);
+
+	/// Returns the number of updates the workers pushed in the last call to train
+	uint64_t updates() const;
+
+protected:
+	void allocate(size_t parameters);
+	void release();
+	void work(NeuralNet& nn, const MatrixView& features, const MatrixView& labels, size_t worker);
+	void push(const double* local, const double* base, size_t count);
+	uint64_t pull(double* local, size_t count);
+	void lock();
+	void unlock();
+};
+
+
+#endif // PARAMSERVER_H
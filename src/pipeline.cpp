@@ -0,0 +1,330 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "pipeline.h"
+#include "neuralnet.h"
+#include "matrix.h"
+#include "rand.h"
+#include "error.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <thread>
+
+using std::vector;
+
+
+// Drains one mini-batch, with each thread of the pool running its share of the stages
+struct PipelineTrainer::StageJob : public ThreadPool::Job
+{
+	PipelineTrainer& m_trainer;
+
+	StageJob(PipelineTrainer& trainer) : m_trainer(trainer) {}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		m_trainer.drain(part, parts);
+	}
+};
+
+
+PipelineTrainer::PipelineTrainer(NeuralNet& nn, const PipelineOptions& options, ThreadPool* pPool)
+: m_nn(nn), m_pool(pPool ? *pPool : ThreadPool::shared()), m_options(options), m_in_flight(0), m_learning_rate(0.0), m_drained(0)
+{
+	if(nn.m_layers.size() == 0)
+		throw Ex("Expected a network with at least one layer");
+	if(nn.isFrozen())
+		throw Ex("This network is frozen. Call thaw before training it.");
+	for(size_t i = 0; i < nn.m_layers.size(); i++)
+	{
+		if(nn.m_layers[i]->m_pruned)
+			throw Ex("Pipeline training does not support pruned layers");
+	}
+	m_options.stages = std::max((size_t)1, std::min(m_options.stages, nn.m_layers.size()));
+	m_options.micro_batches = std::max((size_t)1, m_options.micro_batches);
+	m_options.micro_batch_rows = std::max((size_t)1, m_options.micro_batch_rows);
+	partition();
+
+	size_t slots = m_options.micro_batches * m_options.micro_batch_rows;
+	size_t layers = nn.m_layers.size();
+	m_activation.resize(layers);
+	m_error.resize(layers);
+	m_weight_grad.resize(layers);
+	m_bias_grad.resize(layers);
+	for(size_t i = 0; i < layers; i++)
+	{
+		const Layer& layer = *nn.m_layers[i];
+		m_activation[i].resize(slots * layer.outputs());
+		m_error[i].resize(slots * layer.outputs());
+		m_weight_grad[i].resize(layer.outputs() * layer.inputs());
+		m_bias_grad[i].resize(layer.outputs());
+	}
+	m_input.resize(slots * nn.m_layers[0]->inputs());
+	m_target.resize(slots * nn.m_layers[layers - 1]->outputs());
+	m_counts.resize(m_options.micro_batches);
+
+	for(size_t s = 0; s < m_stages.size(); s++)
+	{
+		m_stages[s].pForward = new BoundedQueue<size_t>(m_options.micro_batches);
+		m_stages[s].pBackward = new BoundedQueue<size_t>(m_options.micro_batches);
+		m_stages[s].backwardDone = 0;
+	}
+}
+
+PipelineTrainer::~PipelineTrainer()
+{
+	for(size_t s = 0; s < m_stages.size(); s++)
+	{
+		delete(m_stages[s].pForward);
+		delete(m_stages[s].pBackward);
+	}
+}
+
+void PipelineTrainer::partition()
+{
+	// Cut the layers into contiguous groups so that the heaviest group is as
+	// light as possible. (cost[s][i] is the best we can do with the first i
+	// layers in s stages, found by trying every position for the last cut.)
+	size_t layers = m_nn.m_layers.size();
+	size_t stages = m_options.stages;
+	vector<size_t> prefix(layers + 1, 0);
+	for(size_t i = 0; i < layers; i++)
+		prefix[i + 1] = prefix[i] + m_nn.m_layers[i]->parameterCount();
+	size_t none = (size_t)-1;
+	vector< vector<size_t> > cost(stages + 1, vector<size_t>(layers + 1, none));
+	vector< vector<size_t> > cut(stages + 1, vector<size_t>(layers + 1, 0));
+	cost[0][0] = 0;
+	for(size_t s = 1; s <= stages; s++)
+	{
+		for(size_t i = s; i <= layers; i++)
+		{
+			for(size_t k = s - 1; k < i; k++)
+			{
+				if(cost[s - 1][k] == none)
+					continue;
+				size_t c = std::max(cost[s - 1][k], prefix[i] - prefix[k]);
+				if(c < cost[s][i])
+				{
+					cost[s][i] = c;
+					cut[s][i] = k;
+				}
+			}
+		}
+	}
+	m_stages.resize(stages);
+	size_t end = layers;
+	for(size_t s = stages; s > 0; s--)
+	{
+		m_stages[s - 1].first = cut[s][end];
+		m_stages[s - 1].end = end;
+		end = cut[s][end];
+	}
+}
+
+vector<size_t> PipelineTrainer::boundaries() const
+{
+	vector<size_t> b;
+	for(size_t s = 0; s < m_stages.size(); s++)
+		b.push_back(m_stages[s].first);
+	return b;
+}
+
+bool PipelineTrainer::step(size_t stage)
+{
+	// Backward work first, so finished micro-batches free their slots sooner
+	Stage& st = m_stages[stage];
+	size_t micro = 0;
+	if(st.pBackward->tryPop(micro))
+		backward(stage, micro);
+	else if(st.pForward->tryPop(micro))
+	{
+		forward(stage, micro);
+		if(stage + 1 < m_stages.size())
+		{
+			// (The queues hold a whole mini-batch, so this never waits)
+			while(!m_stages[stage + 1].pForward->tryPush(micro))
+				std::this_thread::yield();
+		}
+		else
+			backward(stage, micro);
+	}
+	else
+		return false;
+	return true;
+}
+
+void PipelineTrainer::drain(size_t part, size_t parts)
+{
+	// This thread runs stages part, part + parts, ... until the mini-batch is back
+	if(part >= m_stages.size())
+		return;
+	while(m_drained.load(std::memory_order_acquire) < m_in_flight)
+	{
+		bool busy = false;
+		for(size_t s = part; s < m_stages.size(); s += parts)
+		{
+			if(step(s))
+				busy = true;
+		}
+		if(!busy)
+			std::this_thread::yield();
+	}
+}
+
+void PipelineTrainer::forward(size_t stage, size_t micro)
+{
+	const Stage& st = m_stages[stage];
+	size_t slot = micro * m_options.micro_batch_rows;
+	for(size_t r = 0; r < m_counts[micro]; r++)
+	{
+		for(size_t l = st.first; l < st.end; l++)
+		{
+			const Layer& layer = *m_nn.m_layers[l];
+			const double* pIn = l == 0 ? &m_input[(slot + r) * layer.inputs()] : &m_activation[l - 1][(slot + r) * layer.inputs()];
+			layer.compute(pIn, &m_activation[l][(slot + r) * layer.outputs()]);
+		}
+	}
+}
+
+void PipelineTrainer::backward(size_t stage, size_t micro)
+{
+	Stage& st = m_stages[stage];
+	size_t slot = micro * m_options.micro_batch_rows;
+	size_t last = m_nn.m_layers.size() - 1;
+	for(size_t r = 0; r < m_counts[micro]; r++)
+	{
+		for(size_t l = st.end; l-- > st.first; )
+		{
+			const Layer& layer = *m_nn.m_layers[l];
+			size_t ins = layer.inputs();
+			size_t outs = layer.outputs();
+			const double* pAct = &m_activation[l][(slot + r) * outs];
+			double* pErr = &m_error[l][(slot + r) * outs];
+
+			// The error terms of this layer. (For hidden layers, the layer
+			// above already left the back-propagated sums in pErr.)
+			if(l == last)
+			{
+				const double* pTarget = &m_target[(slot + r) * outs];
+				for(size_t j = 0; j < outs; j++)
+					pErr[j] = (pTarget[j] - pAct[j]) * (1.0 - pAct[j] * pAct[j]);
+			}
+			else
+			{
+				for(size_t j = 0; j < outs; j++)
+					pErr[j] *= 1.0 - pAct[j] * pAct[j];
+			}
+
+			// Accumulate the gradient
+			const double* pIn = l == 0 ? &m_input[(slot + r) * ins] : &m_activation[l - 1][(slot + r) * ins];
+			double* pWeightGrad = m_weight_grad[l].data();
+			for(size_t j = 0; j < outs; j++)
+			{
+				double* pRow = &pWeightGrad[j * ins];
+				for(size_t i = 0; i < ins; i++)
+					pRow[i] += pErr[j] * pIn[i];
+				m_bias_grad[l][j] += pErr[j];
+			}
+
+			// Send the error back through this layer's weights, before any update
+			if(l > 0)
+			{
+				double* pBack = &m_error[l - 1][(slot + r) * ins];
+				std::fill(pBack, pBack + ins, 0.0);
+				for(size_t j = 0; j < outs; j++)
+				{
+					const double* pW = layer.m_weights[j].data();
+					for(size_t i = 0; i < ins; i++)
+						pBack[i] += pW[i] * pErr[j];
+				}
+			}
+		}
+	}
+
+	// The last micro-batch of a mini-batch updates this stage's layers. The
+	// stages below cannot start the next mini-batch until they hear back.
+	if(++st.backwardDone == m_in_flight)
+	{
+		st.backwardDone = 0;
+		apply(stage);
+	}
+	if(stage > 0)
+	{
+		while(!m_stages[stage - 1].pBackward->tryPush(micro))
+			std::this_thread::yield();
+	}
+	else
+		m_drained.fetch_add(1, std::memory_order_release);
+}
+
+void PipelineTrainer::apply(size_t stage)
+{
+	const Stage& st = m_stages[stage];
+	for(size_t l = st.first; l < st.end; l++)
+	{
+		Layer& layer = *m_nn.m_layers[l];
+		size_t ins = layer.inputs();
+		double* pWeightGrad = m_weight_grad[l].data();
+		for(size_t j = 0; j < layer.outputs(); j++)
+		{
+			double* pW = layer.m_weights[j].data();
+			double* pRow = &pWeightGrad[j * ins];
+			for(size_t i = 0; i < ins; i++)
+			{
+				pW[i] += m_learning_rate * pRow[i];
+				pRow[i] = 0.0;
+			}
+			layer.m_bias[j] += m_learning_rate * m_bias_grad[l][j];
+			m_bias_grad[l][j] = 0.0;
+		}
+	}
+}
+
+void PipelineTrainer::train(const MatrixView& features, const MatrixView& labels)
+{
+	if(features.rows() != labels.rows())
+		throw Ex("mismatching feature and label rows");
+	size_t rows = features.rows();
+	size_t ins = m_nn.m_layers[0]->inputs();
+	size_t outs = m_nn.m_layers[m_nn.m_layers.size() - 1]->outputs();
+	if(features.cols() != ins || labels.cols() != outs)
+		throw Ex("The data does not fit the network's inputs and outputs");
+	vector<size_t> indexes(rows);
+	for(size_t i = 0; i < rows; i++)
+		indexes[i] = i;
+
+	size_t batchRows = m_options.micro_batches * m_options.micro_batch_rows;
+	m_learning_rate = m_options.learning_rate;
+	bool normalized = m_nn.m_input_shift.size() > 0;
+	for(size_t epoch = 0; epoch < m_options.epochs; epoch++)
+	{
+		for(size_t j = rows; j > 1; j--)
+			std::swap(indexes[j - 1], indexes[m_nn.m_rand.next(j)]);
+		for(size_t start = 0; start < rows; start += batchRows)
+		{
+			// Fill the slots of this mini-batch, then start each micro-batch
+			size_t count = std::min(batchRows, rows - start);
+			for(size_t k = 0; k < count; k++)
+			{
+				size_t index = indexes[start + k];
+				if(normalized)
+					m_nn.normalize(features[index], &m_input[k * ins]);
+				else
+					std::copy(features[index], features[index] + ins, m_input.begin() + k * ins);
+				std::copy(labels[index], labels[index] + outs, m_target.begin() + k * outs);
+			}
+			m_in_flight = (count + m_options.micro_batch_rows - 1) / m_options.micro_batch_rows;
+			for(size_t m = 0; m < m_in_flight; m++)
+				m_counts[m] = std::min(m_options.micro_batch_rows, count - m * m_options.micro_batch_rows);
+			m_drained.store(0);
+			for(size_t m = 0; m < m_in_flight; m++)
+				m_stages[0].pForward->tryPush(m);
+			StageJob job(*this);
+			if(!m_pool.tryRun(job))
+				job.run(0, 1);
+		}
+		m_learning_rate *= 0.997;
+	}
+	m_nn.m_version++; // the stages changed the weights directly
+}
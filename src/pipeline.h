@@ -0,0 +1,98 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <vector>
+#include <atomic>
+#include <stddef.h>
+#include "queue.h"
+
+class NeuralNet;
+class MatrixView;
+class ThreadPool;
+
+
+/// Settings for PipelineTrainer
+struct PipelineOptions
+{
+	size_t stages; // contiguous groups of layers, each of which is run by one thread
+	size_t micro_batches; // micro-batches in flight per mini-batch
+	size_t micro_batch_rows; // patterns per micro-batch
+	size_t epochs;
+	double learning_rate; // decays by 0.997 per epoch, like NeuralNet::train
+
+	PipelineOptions() : stages(2), micro_batches(4), micro_batch_rows(8), epochs(100), learning_rate(0.1) {}
+};
+
+
+/// Trains a NeuralNet with pipeline parallelism, GPipe style. The layers are
+/// split into contiguous stages of roughly equal weight, which are dealt out
+/// to the threads of a ThreadPool. A mini-batch is cut into micro-batches that stream
+/// forward through the stages and back again, so every stage works on a
+/// different micro-batch at once. Stages pass micro-batch numbers through
+/// lock-free queues, and each one prefers backward work to forward work
+/// (one-forward-one-backward) to keep the number of stored activations low.
+/// Gradients are summed over the mini-batch and applied when it has drained,
+/// so the result does not depend on the number of stages.
+class PipelineTrainer
+{
+protected:
+	struct StageJob;
+
+	struct Stage
+	{
+		size_t first; // the first layer of this stage
+		size_t end; // one past the last layer
+		BoundedQueue<size_t>* pForward; // micro-batches ready for this stage's forward pass
+		BoundedQueue<size_t>* pBackward; // micro-batches ready for this stage's backward pass
+		size_t backwardDone; // in the current mini-batch
+	};
+
+	NeuralNet& m_nn;
+	ThreadPool& m_pool;
+	PipelineOptions m_options;
+	std::vector<Stage> m_stages;
+	std::vector< std::vector<double> > m_activation; // per layer: [micro-batch row][unit]
+	std::vector< std::vector<double> > m_error; // per layer: [micro-batch row][unit]
+	std::vector< std::vector<double> > m_weight_grad; // per layer: [output][input]
+	std::vector< std::vector<double> > m_bias_grad; // per layer
+	std::vector<double> m_input; // [micro-batch row][input]
+	std::vector<double> m_target; // [micro-batch row][output]
+	std::vector<size_t> m_counts; // the rows in each micro-batch of the current mini-batch
+	size_t m_in_flight; // micro-batches in the current mini-batch
+	double m_learning_rate;
+	std::atomic<size_t> m_drained; // micro-batches that have come all the way back
+
+public:
+	/// Splits nn into stages. (Pruned layers are not supported.) The stages
+	/// run on pPool, or on the shared pool if it is NULL. When the pool has
+	/// fewer threads than there are stages, or it is busy, some threads run
+	/// several stages in turn.
+	PipelineTrainer(NeuralNet& nn, const PipelineOptions& options = PipelineOptions(), ThreadPool* pPool = NULL);
+	~PipelineTrainer();
+
+	/// Returns the number of stages (which may be fewer than requested, if
+	/// there are fewer layers)
+	size_t stages() const { return m_stages.size(); }
+
+	/// Returns the first layer of each stage
+	std::vector<size_t> boundaries() const;
+
+	/// Trains on every row for the configured number of epochs
+	void train(const MatrixView& features, const MatrixView& labels);
+
+protected:
+	void partition();
+	bool step(size_t stage);
+	void drain(size_t part, size_t parts);
+	void forward(size_t stage, size_t micro);
+	void backward(size_t stage, size_t micro);
+	void apply(size_t stage);
+};
+
+
+#endif // PIPELINE_H
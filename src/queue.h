@@ -0,0 +1,121 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <utility>
+
+
+/// A bounded, lock-free, multi-producer multi-consumer ring buffer. (This is
+/// Dmitry Vyukov's design: each cell carries a sequence number that tells
+/// producers and consumers whose turn it is.) Elements are copied into cells
+/// that are reused, so once the vectors inside T have grown to full size,
+/// pushing and popping do not allocate.
+template<typename T>
+class BoundedQueue
+{
+protected:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	Cell* m_cells;
+	size_t m_mask;
+	char m_pad0[64];
+	std::atomic<size_t> m_head; // the next position to push
+	char m_pad1[64];
+	std::atomic<size_t> m_tail; // the next position to pop
+	char m_pad2[64];
+
+public:
+	/// The capacity is rounded up to a power of 2
+	BoundedQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while(size < capacity)
+			size *= 2;
+		m_cells = new Cell[size];
+		m_mask = size - 1;
+		for(size_t i = 0; i < size; i++)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+		m_head.store(0, std::memory_order_relaxed);
+		m_tail.store(0, std::memory_order_relaxed);
+	}
+
+	~BoundedQueue()
+	{
+		delete[] m_cells;
+	}
+
+	size_t capacity() const { return m_mask + 1; }
+
+	/// Copies value into the queue. Returns false if the queue is full.
+	bool tryPush(const T& value)
+	{
+		size_t pos = m_head.load(std::memory_order_relaxed);
+		while(true)
+		{
+			Cell& cell = m_cells[pos & m_mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+			if(diff == 0)
+			{
+				if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					cell.data = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if(diff < 0)
+				return false;
+			else
+				pos = m_head.load(std::memory_order_relaxed);
+		}
+	}
+
+	/// Swaps the oldest element into out. Returns false if the queue is empty.
+	bool tryPop(T& out)
+	{
+		size_t pos = m_tail.load(std::memory_order_relaxed);
+		while(true)
+		{
+			Cell& cell = m_cells[pos & m_mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+			if(diff == 0)
+			{
+				if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					std::swap(out, cell.data);
+					cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if(diff < 0)
+				return false;
+			else
+				pos = m_tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	/// Returns true if the queue looked empty at the moment it was checked
+	bool empty() const
+	{
+		return m_tail.load(std::memory_order_seq_cst) == m_head.load(std::memory_order_seq_cst);
+	}
+
+private:
+	BoundedQueue(const BoundedQueue& other);
+	BoundedQueue& operator=(const BoundedQueue& other);
+};
+
+
+#endif // QUEUE_H
@@ -19,14 +19,31 @@ Rand::Rand(uint64 seed)
 	setSeed(seed);
 }
 
+Rand::Rand(uint64 seed, uint64 stream)
+{
+	setSeed(seed, stream);
+}
+
 Rand::~Rand()
 {
 }
 
 void Rand::setSeed(uint64 seed)
 {
-	m_b = 0xCA535ACA9535ACB2ull + seed;
-	m_a = 0x6CCF6660A66C35E7ull + (seed << 24);
+	setSeed(seed, 0);
+}
+
+void Rand::setSeed(uint64 seed, uint64 stream)
+{
+	m_seed = seed;
+	m_stream = stream;
+
+	// Other streams start from a scrambled seed, so their states land far apart
+	uint64 s = seed;
+	if(stream != 0)
+		s = mix(seed + mix(stream ^ 0x9E3779B97F4A7C15ull));
+	m_b = 0xCA535ACA9535ACB2ull + s;
+	m_a = 0x6CCF6660A66C35E7ull + (s << 24);
 }
 
 uint64 Rand::next(uint64 range)
@@ -61,6 +78,40 @@ double Rand::normal()
 	return y * sqrt(-2.0 * log(mag) / mag); // the Box-Muller transform	
 }
 
+void Rand::fillUniform(double* pOut, size_t n)
+{
+	uint64 a = m_a;
+	uint64 b = m_b;
+	for(size_t i = 0; i < n; i++)
+	{
+		a = 0x141F2B69ull * (a & 0x3ffffffffull) + (a >> 32);
+		b = 0xC2785A6Bull * (b & 0x3ffffffffull) + (b >> 32);
+		pOut[i] = (double)((a ^ b) & 0xfffffffffffffull) * (1.0 / 4503599627370496.0);
+	}
+	m_a = a;
+	m_b = b;
+}
+
+void Rand::fillNormal(double* pOut, size_t n)
+{
+	// This is the same polar Box-Muller transform as normal(), except that
+	// both of the values it produces are kept
+	size_t i = 0;
+	while(i + 1 < n)
+	{
+		double x = uniform() * 2 - 1;
+		double y = uniform() * 2 - 1;
+		double mag = x * x + y * y;
+		if(mag >= 1.0 || mag == 0)
+			continue;
+		double scale = sqrt(-2.0 * log(mag) / mag);
+		pOut[i++] = x * scale;
+		pOut[i++] = y * scale;
+	}
+	if(i < n)
+		pOut[i] = normal();
+}
+
 int Rand::categorical(vector<double>& probabilities)
 {
 	double d = uniform();
@@ -7,6 +7,7 @@
 #define RAND_H
 
 #include <vector>
+#include <stddef.h>
 
 
 typedef unsigned long long int uint64;
@@ -23,14 +24,54 @@ class Rand
 protected:
 	uint64 m_a;
 	uint64 m_b;
+	uint64 m_seed; // remembered so that independent streams can be derived from it
+	uint64 m_stream;
+
+	// A bijective 64-bit mixing function (the SplitMix64 finalizer)
+	static uint64 mix(uint64 x)
+	{
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		return x ^ (x >> 31);
+	}
 
 public:
 	Rand(uint64 seed);
+
+	// Makes the generator for stream number "stream" of the specified seed.
+	// (Stream 0 is the same sequence that Rand(seed) produces.)
+	Rand(uint64 seed, uint64 stream);
+
 	~Rand();
 
 	// Sets the seed
 	void setSeed(uint64 seed);
 
+	// Sets the seed, and selects one of the independent streams that
+	// can be derived from it
+	void setSeed(uint64 seed, uint64 stream);
+
+	// Returns a generator for the specified stream of this generator's seed.
+	// The result does not depend on how many values have already been drawn
+	// from this generator, so a parallel job can hand stream i to worker i
+	// and get the same results no matter how the work is scheduled.
+	Rand split(uint64 stream) const { return Rand(m_seed, stream); }
+
+	// Returns the counter-th value of a counter-based sequence keyed on this
+	// generator's seed and stream. It does not touch the generator state, so
+	// any number of threads may call it at once, and the value for a given
+	// counter (a sample or unit index, for example) is always the same.
+	uint64 at(uint64 counter) const
+	{
+		return mix(mix(m_seed ^ mix(m_stream)) + (counter + 1) * 0x9E3779B97F4A7C15ull);
+	}
+
+	// Like at, but returns a double from 0 (inclusive) to 1 (exclusive)
+	double uniformAt(uint64 counter) const
+	{
+		return (double)(at(counter) & 0xfffffffffffffull) / 4503599627370496.0;
+	}
+
 	// Returns an unsigned pseudo-random 64-bit value
 	uint64 next()
 	{
@@ -102,6 +143,11 @@ public:
 	// lowercase-sigma), then add the mean (usually mu).)
 	double normal();
 
+	// Fills pOut with n values from a standard normal distribution. This
+	// keeps both outputs of each Box-Muller pair, so it needs about half as
+	// many uniforms, logs, and square roots as calling normal() n times.
+	void fillNormal(double* pOut, size_t n);
+
 	// Returns a random value from a Poisson distribution
 	int poisson(double mu);
 
@@ -128,6 +174,10 @@ public:
 	// mantissa, and discards the extra 12 random bits.
 	double uniform();
 
+	// Fills pOut with n values drawn the same way as uniform(). The
+	// generator state is kept in registers for the whole buffer.
+	void fillUniform(double* pOut, size_t n);
+
 	// Returns a random value from a Weibull distribution with lambda=1.
 	double weibull(double gamma);
 };
@@ -0,0 +1,278 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "search.h"
+#include "neuralnet.h"
+#include "threadpool.h"
+#include "rand.h"
+#include "error.h"
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+
+using std::vector;
+
+
+// One configuration being trained on one fold
+struct SearchTrial
+{
+	Rand rand; // (declared before nn, which keeps a reference to it)
+	NeuralNet nn;
+	const MatrixView* pTrainFeatures;
+	const MatrixView* pTrainLabels;
+	const MatrixView* pValidateFeatures;
+	const MatrixView* pValidateLabels;
+	vector<size_t> order;
+	double learning_rate;
+	size_t epochs;
+	double rmse;
+
+	SearchTrial(const Rand& r) : rand(r), nn(rand), epochs(0), rmse(0.0) {}
+
+	// Trains until the specified number of epochs, the same way as
+	// NeuralNet::train with SHUFFLE_INDEXES, then measures the validation error
+	void advance(size_t target)
+	{
+		for(; epochs < target; epochs++)
+		{
+			for(size_t j = order.size(); j > 1; j--)
+				std::swap(order[j - 1], order[rand.next(j)]);
+			for(size_t j = 0; j < order.size(); j++)
+				nn.refine((*pTrainFeatures)[order[j]], (*pTrainLabels)[order[j]], learning_rate);
+			learning_rate *= 0.997;
+		}
+		rmse = nn.evaluate(*pValidateFeatures, *pValidateLabels).rmse;
+		if(!(rmse < 1e308)) // (a diverged network ranks last)
+			rmse = 1e308;
+	}
+};
+
+
+// Advances a list of trials, with each thread taking the next one that is left
+struct ModelSearch::Job : public ThreadPool::Job
+{
+	const vector<SearchTrial*>& m_trials;
+	size_t m_target;
+	std::atomic<size_t> m_next;
+	std::atomic<bool> m_failed;
+
+	Job(const vector<SearchTrial*>& trials, size_t target)
+	: m_trials(trials), m_target(target), m_next(0), m_failed(false)
+	{
+	}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		size_t i;
+		while((i = m_next.fetch_add(1)) < m_trials.size())
+		{
+			try
+			{
+				m_trials[i]->advance(m_target);
+			}
+			catch(...)
+			{
+				m_failed.store(true);
+			}
+		}
+	}
+};
+
+
+ModelSearch::ModelSearch(const MatrixView& features, const MatrixView& labels, const SearchSpace& space, const SearchOptions& options)
+: m_features(features), m_labels(labels), m_options(options)
+{
+	if(features.rows() != labels.rows())
+		throw Ex("mismatching feature and label rows");
+	if(m_options.folds < 2 || features.rows() < m_options.folds)
+		throw Ex("Cross-validation needs at least 2 folds, and a row for each fold");
+	if(space.topologies.size() == 0 || space.learning_rates.size() == 0)
+		throw Ex("The search space needs at least one topology and one learning rate");
+	for(size_t i = 0; i < space.topologies.size(); i++)
+	{
+		for(size_t j = 0; j < space.topologies[i].size(); j++)
+		{
+			if(space.topologies[i][j] == 0)
+				throw Ex("Hidden layers must have at least 1 unit");
+		}
+	}
+	m_options.epochs = std::max((size_t)1, m_options.epochs);
+	m_options.min_epochs = std::max((size_t)1, std::min(m_options.min_epochs, m_options.epochs));
+	m_options.reduction = std::max((size_t)2, m_options.reduction);
+
+	SearchResult config;
+	config.epochs = 0;
+	config.rmse = 0.0;
+	config.rmse_deviation = 0.0;
+	if(space.samples == 0)
+	{
+		for(size_t i = 0; i < space.topologies.size(); i++)
+		{
+			for(size_t j = 0; j < space.learning_rates.size(); j++)
+			{
+				config.hidden = space.topologies[i];
+				config.learning_rate = space.learning_rates[j];
+				m_configs.push_back(config);
+			}
+		}
+	}
+	else
+	{
+		double lo = *std::min_element(space.learning_rates.begin(), space.learning_rates.end());
+		double hi = *std::max_element(space.learning_rates.begin(), space.learning_rates.end());
+		if(lo <= 0.0)
+			throw Ex("Random search needs positive learning rates");
+		Rand r = Rand(m_options.seed).split(0);
+		for(size_t i = 0; i < space.samples; i++)
+		{
+			config.hidden = space.topologies[(size_t)r.next(space.topologies.size())];
+			config.learning_rate = lo * pow(hi / lo, r.uniform());
+			m_configs.push_back(config);
+		}
+	}
+	makeFolds();
+}
+
+void ModelSearch::makeFolds()
+{
+	// Deal the shuffled rows out to the folds in turn
+	size_t rows = m_features.rows();
+	vector<size_t> perm(rows);
+	for(size_t i = 0; i < rows; i++)
+		perm[i] = i;
+	Rand r = Rand(m_options.seed).split(1);
+	for(size_t j = rows; j > 1; j--)
+		std::swap(perm[j - 1], perm[r.next(j)]);
+	m_train_rows.resize(m_options.folds);
+	m_validate_rows.resize(m_options.folds);
+	for(size_t i = 0; i < rows; i++)
+	{
+		size_t fold = i % m_options.folds;
+		for(size_t k = 0; k < m_options.folds; k++)
+			(k == fold ? m_validate_rows : m_train_rows)[k].push_back(perm[i]);
+	}
+}
+
+// Sorts configurations best first
+static bool betterResult(const SearchResult& a, const SearchResult& b)
+{
+	if(a.epochs != b.epochs)
+		return a.epochs > b.epochs;
+	return a.rmse < b.rmse;
+}
+
+std::vector<SearchResult> ModelSearch::run(ThreadPool* pPool)
+{
+	ThreadPool& pool = pPool ? *pPool : ThreadPool::shared();
+	size_t folds = m_options.folds;
+	size_t ins = m_features.cols();
+	size_t outs = m_labels.cols();
+
+	// Each fold is a pair of index lists over the caller's data
+	vector<MatrixView> trainFeatures, trainLabels, validateFeatures, validateLabels;
+	for(size_t k = 0; k < folds; k++)
+	{
+		trainFeatures.push_back(m_features.select(m_train_rows[k]));
+		trainLabels.push_back(m_labels.select(m_train_rows[k]));
+		validateFeatures.push_back(m_features.select(m_validate_rows[k]));
+		validateLabels.push_back(m_labels.select(m_validate_rows[k]));
+	}
+
+	vector<SearchTrial*> trials(m_configs.size() * folds, NULL);
+	vector<size_t> alive;
+	try
+	{
+		Rand base(m_options.seed);
+		for(size_t c = 0; c < m_configs.size(); c++)
+		{
+			alive.push_back(c);
+			vector<size_t> widths(1, ins);
+			widths.insert(widths.end(), m_configs[c].hidden.begin(), m_configs[c].hidden.end());
+			widths.push_back(outs);
+			for(size_t k = 0; k < folds; k++)
+			{
+				SearchTrial* pTrial = new SearchTrial(base.split(2 + c * folds + k));
+				trials[c * folds + k] = pTrial;
+				for(size_t l = 0; l + 1 < widths.size(); l++)
+					pTrial->nn.m_layers.push_back(new Layer(widths[l], widths[l + 1]));
+				pTrial->nn.init();
+				pTrial->pTrainFeatures = &trainFeatures[k];
+				pTrial->pTrainLabels = &trainLabels[k];
+				pTrial->pValidateFeatures = &validateFeatures[k];
+				pTrial->pValidateLabels = &validateLabels[k];
+				pTrial->order.resize(m_train_rows[k].size());
+				for(size_t i = 0; i < pTrial->order.size(); i++)
+					pTrial->order[i] = i;
+				pTrial->learning_rate = m_configs[c].learning_rate;
+			}
+		}
+
+		size_t budget = m_options.min_epochs;
+		while(true)
+		{
+			vector<SearchTrial*> round;
+			for(size_t i = 0; i < alive.size(); i++)
+			{
+				for(size_t k = 0; k < folds; k++)
+					round.push_back(trials[alive[i] * folds + k]);
+			}
+			Job job(round, budget);
+			pool.run(job);
+			if(job.m_failed.load())
+				throw Ex("A training job failed");
+
+			vector< std::pair<double, size_t> > ranked;
+			for(size_t i = 0; i < alive.size(); i++)
+			{
+				SearchResult& config = m_configs[alive[i]];
+				double sum = 0.0;
+				double sumSquares = 0.0;
+				for(size_t k = 0; k < folds; k++)
+				{
+					double rmse = trials[alive[i] * folds + k]->rmse;
+					sum += rmse;
+					sumSquares += rmse * rmse;
+				}
+				config.epochs = budget;
+				config.rmse = sum / folds;
+				config.rmse_deviation = sqrt(std::max(0.0, sumSquares / folds - config.rmse * config.rmse));
+				ranked.push_back(std::make_pair(config.rmse, alive[i]));
+			}
+			if(budget >= m_options.epochs)
+				break;
+
+			// Cut all but the best 1 / reduction of the configurations
+			std::sort(ranked.begin(), ranked.end());
+			size_t keep = std::max((size_t)1, (alive.size() + m_options.reduction - 1) / m_options.reduction);
+			alive.clear();
+			for(size_t i = 0; i < ranked.size(); i++)
+			{
+				if(i < keep)
+				{
+					alive.push_back(ranked[i].second);
+					continue;
+				}
+				for(size_t k = 0; k < folds; k++)
+				{
+					delete(trials[ranked[i].second * folds + k]);
+					trials[ranked[i].second * folds + k] = NULL;
+				}
+			}
+			budget = std::min(m_options.epochs, budget * m_options.reduction);
+		}
+	}
+	catch(...)
+	{
+		for(size_t i = 0; i < trials.size(); i++)
+			delete(trials[i]);
+		throw;
+	}
+	for(size_t i = 0; i < trials.size(); i++)
+		delete(trials[i]);
+
+	vector<SearchResult> results(m_configs);
+	std::stable_sort(results.begin(), results.end(), betterResult);
+	return results;
+}
@@ -0,0 +1,92 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "matrix.h"
+
+class ThreadPool;
+
+
+/// The configurations a ModelSearch tries
+struct SearchSpace
+{
+	std::vector< std::vector<size_t> > topologies; // the widths of the hidden layers of each candidate
+	std::vector<double> learning_rates; // initial rates, which decay by 0.997 per epoch like NeuralNet::train
+	size_t samples; // 0 tries every topology with every rate. Otherwise, this many random
+	                // pairs of a topology and a rate drawn log-uniformly between the
+	                // smallest and largest of learning_rates.
+
+	SearchSpace() : samples(0) {}
+};
+
+
+/// Settings for a ModelSearch
+struct SearchOptions
+{
+	size_t folds; // for cross-validation
+	size_t epochs; // the most epochs any configuration trains for
+	size_t min_epochs; // the epochs every configuration gets before the first cut
+	size_t reduction; // each cut keeps 1 / reduction of the configurations, and the survivors train reduction times longer
+	uint64_t seed;
+
+	SearchOptions() : folds(5), epochs(500), min_epochs(20), reduction(3), seed(0) {}
+};
+
+
+/// How one configuration did
+struct SearchResult
+{
+	std::vector<size_t> hidden;
+	double learning_rate;
+	size_t epochs; // the epochs it trained for before it was cut (or the full count)
+	double rmse; // the mean validation RMSE over the folds, after that many epochs
+	double rmse_deviation; // the standard deviation of the validation RMSE over the folds
+};
+
+
+/// Cross-validates many network configurations at once, with successive
+/// halving. Every (configuration, fold) pair is an independent training job,
+/// and the jobs are dealt out to the threads of a ThreadPool. After each
+/// round, the configurations with the worst mean validation error are cut,
+/// and the rest train reduction times longer, so most of the time goes to
+/// the promising ones. Folds are index lists over the caller's data, so
+/// nothing is copied. Each job draws from its own split of the seed, so the
+/// results do not depend on the number of threads.
+class ModelSearch
+{
+protected:
+	struct Job;
+
+	MatrixView m_features;
+	MatrixView m_labels;
+	SearchOptions m_options;
+	std::vector<SearchResult> m_configs;
+	std::vector< std::vector<size_t> > m_train_rows; // per fold
+	std::vector< std::vector<size_t> > m_validate_rows; // per fold
+
+public:
+	/// Prepares to search space with features and labels, which must stay
+	/// alive and unchanged until run returns
+	ModelSearch(const MatrixView& features, const MatrixView& labels, const SearchSpace& space, const SearchOptions& options = SearchOptions());
+
+	/// Returns the configurations that will be tried
+	const std::vector<SearchResult>& configurations() const { return m_configs; }
+
+	/// Runs the search on pPool (or the shared pool if it is NULL), and
+	/// returns every configuration, best first. Configurations that trained
+	/// longer rank above those that were cut, and ties are broken by RMSE.
+	std::vector<SearchResult> run(ThreadPool* pPool = NULL);
+
+protected:
+	void makeFolds();
+};
+
+
+#endif // SEARCH_H
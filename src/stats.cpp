@@ -0,0 +1,81 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "stats.h"
+
+#ifdef NN_ENABLE_STATS
+
+using std::map;
+
+// The number of (collector, shard) pairs each thread remembers
+#define SHARD_CACHE_SIZE 8
+
+static std::atomic<uint64_t> g_next_collector_id(1);
+
+StatsCollector::Shard::Shard()
+{
+	samples.store(0);
+	bytes.store(0);
+	for(size_t i = 0; i < NN_STATS_MAX_LAYERS; i++)
+	{
+		for(size_t j = 0; j < COUNTER_COUNT; j++)
+			layers[i][j].store(0);
+	}
+}
+
+StatsCollector::StatsCollector()
+: m_id(g_next_collector_id.fetch_add(1))
+{
+}
+
+StatsCollector::~StatsCollector()
+{
+	for(map<std::thread::id, Shard*>::iterator it = m_shards.begin(); it != m_shards.end(); it++)
+		delete(it->second);
+}
+
+StatsCollector::Shard& StatsCollector::shard()
+{
+	// A small direct-mapped cache keeps the common case lock-free, even when
+	// one thread alternates between a few networks
+	static thread_local uint64_t t_ids[SHARD_CACHE_SIZE];
+	static thread_local Shard* t_shards[SHARD_CACHE_SIZE];
+	size_t slot = m_id % SHARD_CACHE_SIZE;
+	if(t_ids[slot] == m_id)
+		return *t_shards[slot];
+
+	std::lock_guard<std::mutex> guard(m_lock);
+	Shard*& s = m_shards[std::this_thread::get_id()];
+	if(!s)
+		s = new Shard();
+	t_ids[slot] = m_id;
+	t_shards[slot] = s;
+	return *s;
+}
+
+NetStats StatsCollector::snapshot(size_t layerCount) const
+{
+	NetStats stats;
+	stats.enabled = true;
+	stats.layers.resize(layerCount);
+	std::lock_guard<std::mutex> guard(m_lock);
+	for(map<std::thread::id, Shard*>::const_iterator it = m_shards.begin(); it != m_shards.end(); it++)
+	{
+		const Shard& s = *it->second;
+		stats.samples += s.samples.load(std::memory_order_relaxed);
+		stats.bytes_allocated += s.bytes.load(std::memory_order_relaxed);
+		for(size_t i = 0; i < layerCount && i < NN_STATS_MAX_LAYERS; i++)
+		{
+			LayerStats& l = stats.layers[i];
+			l.forward_ns += s.layers[i][FORWARD_NS].load(std::memory_order_relaxed);
+			l.backward_ns += s.layers[i][BACKWARD_NS].load(std::memory_order_relaxed);
+			l.update_ns += s.layers[i][UPDATE_NS].load(std::memory_order_relaxed);
+			l.flops += s.layers[i][FLOPS].load(std::memory_order_relaxed);
+		}
+	}
+	return stats;
+}
+
+#endif // NN_ENABLE_STATS
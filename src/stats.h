@@ -0,0 +1,156 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef NN_ENABLE_STATS
+#	include <atomic>
+#	include <chrono>
+#	include <map>
+#	include <mutex>
+#	include <thread>
+#endif
+
+
+/// The most layers that the stats counters will distinguish. (Deeper layers are
+/// folded into the last slot.)
+#define NN_STATS_MAX_LAYERS 64
+
+
+/// Counters for one layer of a NeuralNet
+struct LayerStats
+{
+	uint64_t forward_ns;
+	uint64_t backward_ns;
+	uint64_t update_ns;
+	uint64_t flops;
+	uint64_t threads; // the threads its forward pass is split across (reported even without NN_ENABLE_STATS)
+
+	LayerStats() : forward_ns(0), backward_ns(0), update_ns(0), flops(0), threads(1) {}
+};
+
+
+/// A snapshot of the counters collected for one NeuralNet
+struct NetStats
+{
+	bool enabled; // false when the extension was built without NN_ENABLE_STATS
+	uint64_t samples; // number of patterns fed forward
+	uint64_t bytes_allocated; // scratch memory allocated by training and inference
+	uint64_t model_bytes; // memory currently held by the layers
+	std::vector<LayerStats> layers;
+
+	NetStats() : enabled(false), samples(0), bytes_allocated(0), model_bytes(0) {}
+};
+
+
+#ifdef NN_ENABLE_STATS
+
+/// Measures elapsed wall-clock time for the stats counters
+class StatsTimer
+{
+protected:
+	std::chrono::steady_clock::time_point m_start;
+
+public:
+	StatsTimer() : m_start(std::chrono::steady_clock::now()) {}
+
+	/// Returns the nanoseconds since construction (or since the previous call), and restarts the timer
+	uint64_t lap()
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_start).count();
+		m_start = now;
+		return ns;
+	}
+};
+
+
+/// Collects counters for one NeuralNet. Each thread writes to its own
+/// shard without any synchronization, and the shards are only summed
+/// when someone asks for a snapshot.
+class StatsCollector
+{
+protected:
+	enum { FORWARD_NS, BACKWARD_NS, UPDATE_NS, FLOPS, COUNTER_COUNT };
+
+	struct Shard
+	{
+		std::atomic<uint64_t> samples;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> layers[NN_STATS_MAX_LAYERS][COUNTER_COUNT];
+
+		Shard();
+	};
+
+	uint64_t m_id; // unique for the life of the process, so stale thread-local caches never match
+	mutable std::mutex m_lock;
+	std::map<std::thread::id, Shard*> m_shards;
+
+	/// Returns the shard that belongs to the calling thread
+	Shard& shard();
+
+	/// Only the owning thread writes to a shard, so there is no need for an atomic read-modify-write
+	static void bump(std::atomic<uint64_t>& counter, uint64_t amount)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	void add(size_t layer, size_t which, uint64_t ns, uint64_t flops)
+	{
+		Shard& s = shard();
+		if(layer >= NN_STATS_MAX_LAYERS)
+			layer = NN_STATS_MAX_LAYERS - 1;
+		bump(s.layers[layer][which], ns);
+		bump(s.layers[layer][FLOPS], flops);
+	}
+
+public:
+	StatsCollector();
+	~StatsCollector();
+
+	void addForward(size_t layer, uint64_t ns, uint64_t flops) { add(layer, FORWARD_NS, ns, flops); }
+	void addBackward(size_t layer, uint64_t ns, uint64_t flops) { add(layer, BACKWARD_NS, ns, flops); }
+	void addUpdate(size_t layer, uint64_t ns, uint64_t flops) { add(layer, UPDATE_NS, ns, flops); }
+	void addSamples(uint64_t n) { bump(shard().samples, n); }
+	void addBytes(uint64_t n) { bump(shard().bytes, n); }
+
+	/// Sums the counters from every thread
+	NetStats snapshot(size_t layerCount) const;
+
+private:
+	StatsCollector(const StatsCollector& other);
+	StatsCollector& operator=(const StatsCollector& other);
+};
+
+#	define NN_STATS_TIMER(name) StatsTimer name
+#	define NN_STATS(statement) statement
+
+#else // NN_ENABLE_STATS
+
+/// Stands in for the real collector when stats are disabled. Every method is
+/// an empty inline, and the NN_STATS macros discard their arguments, so the
+/// instrumentation compiles to nothing.
+class StatsCollector
+{
+public:
+	NetStats snapshot(size_t layerCount) const
+	{
+		NetStats s;
+		s.layers.resize(layerCount);
+		return s;
+	}
+};
+
+#	define NN_STATS_TIMER(name)
+#	define NN_STATS(statement)
+
+#endif // NN_ENABLE_STATS
+
+
+#endif // STATS_H
@@ -0,0 +1,275 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "threadpool.h"
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+using std::vector;
+
+
+// Tells the CPU that this is a spin loop, so it can save power and let a
+// hyper-threaded sibling run
+static inline void relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+
+// True while this thread is running part of a job, on any pool. A job that
+// is started from inside another one runs inline, so no thread ever waits
+// for a pool that may need it, or tries to take m_busy when it already has it.
+static thread_local bool t_inJob = false;
+
+// Marks this thread as running a job until it goes out of scope
+class JobScope
+{
+protected:
+	bool m_outer;
+
+public:
+	JobScope() : m_outer(t_inJob) { t_inJob = true; }
+	~JobScope() { t_inJob = m_outer; }
+};
+
+
+// Returns the CPUs this process may run on
+static vector<int> allowedCpus()
+{
+	vector<int> cpus;
+	cpu_set_t set;
+	if(sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for(int c = 0; c < CPU_SETSIZE; c++)
+		{
+			if(CPU_ISSET(c, &set))
+				cpus.push_back(c);
+		}
+	}
+	if(cpus.size() == 0)
+	{
+		for(unsigned int c = 0; c < std::max(1u, std::thread::hardware_concurrency()); c++)
+			cpus.push_back((int)c);
+	}
+	return cpus;
+}
+
+// Parses a kernel CPU list, such as "0-3,8-11"
+static vector<int> parseCpuList(const std::string& list)
+{
+	vector<int> cpus;
+	const char* p = list.c_str();
+	while(*p >= '0' && *p <= '9')
+	{
+		char* pEnd;
+		int first = (int)strtol(p, &pEnd, 10);
+		int last = first;
+		if(*pEnd == '-')
+			last = (int)strtol(pEnd + 1, &pEnd, 10);
+		for(int c = first; c <= last; c++)
+			cpus.push_back(c);
+		p = *pEnd == ',' ? pEnd + 1 : pEnd;
+	}
+	return cpus;
+}
+
+// Orders the allowed CPUs for a pinning policy. The NUMA nodes come from
+// sysfs. Without it, every CPU counts as one node.
+static vector<int> pinningOrder(PinPolicy pin)
+{
+	vector<int> allowed = allowedCpus();
+	vector< vector<int> > nodes;
+	for(int n = 0; ; n++)
+	{
+		std::ifstream file(("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist").c_str());
+		std::string list;
+		if(!file || !std::getline(file, list))
+			break;
+		vector<int> cpus = parseCpuList(list);
+		vector<int> node;
+		for(size_t i = 0; i < cpus.size(); i++)
+		{
+			if(std::find(allowed.begin(), allowed.end(), cpus[i]) != allowed.end())
+				node.push_back(cpus[i]);
+		}
+		if(node.size() > 0)
+			nodes.push_back(node);
+	}
+	if(nodes.size() == 0)
+		nodes.push_back(allowed);
+
+	vector<int> order;
+	if(pin == PIN_COMPACT)
+	{
+		for(size_t n = 0; n < nodes.size(); n++)
+			order.insert(order.end(), nodes[n].begin(), nodes[n].end());
+	}
+	else
+	{
+		for(size_t i = 0; order.size() < allowed.size(); i++)
+		{
+			for(size_t n = 0; n < nodes.size(); n++)
+			{
+				if(i < nodes[n].size())
+					order.push_back(nodes[n][i]);
+			}
+		}
+	}
+	return order;
+}
+
+
+ThreadPool::ThreadPool(size_t threads, PinPolicy pin)
+: m_pid(getpid()), m_pJob(NULL), m_generation(0), m_pending(0), m_sleeping(0), m_stop(false)
+{
+	if(threads == 0)
+		threads = allowedCpus().size();
+	if(pin != PIN_NONE)
+		m_cpus = pinningOrder(pin);
+	for(size_t i = 1; i < threads; i++)
+		m_workers.push_back(std::thread(&ThreadPool::work, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+	m_stop.store(true);
+	m_generation.fetch_add(1);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_wake.notify_all();
+	}
+	for(size_t i = 0; i < m_workers.size(); i++)
+		m_workers[i].join();
+}
+
+void ThreadPool::run(Job& job)
+{
+	if(!tryRun(job))
+	{
+		JobScope scope;
+		size_t parts = size();
+		for(size_t p = 0; p < parts; p++)
+			job.run(p, parts);
+	}
+}
+
+bool ThreadPool::tryRun(Job& job)
+{
+	size_t parts = size();
+	if(parts == 1)
+	{
+		JobScope scope;
+		job.run(0, 1);
+		return true;
+	}
+	if(t_inJob || getpid() != m_pid || !m_busy.try_lock())
+		return false;
+
+	m_pJob = &job;
+	m_pending.store(parts - 1, std::memory_order_relaxed);
+	m_generation.fetch_add(1); // (seq_cst, so a worker that is going to sleep either sees it or is counted below)
+	if(m_sleeping.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_wake.notify_all();
+	}
+	{
+		JobScope scope;
+		job.run(0, parts);
+	}
+
+	// The other parts are about as long as ours, so this wait is short
+	for(size_t spins = 0; m_pending.load(std::memory_order_acquire) > 0; spins++)
+	{
+		if(spins < THREADPOOL_SPINS)
+			relax();
+		else
+			std::this_thread::yield();
+	}
+	m_pJob = NULL;
+	m_busy.unlock();
+	return true;
+}
+
+static size_t s_threads = 0;
+static PinPolicy s_pin = PIN_NONE;
+static ThreadPool* s_pShared = NULL;
+static std::mutex s_sharedMutex;
+
+// static
+void ThreadPool::configure(size_t threads, PinPolicy pin)
+{
+	std::lock_guard<std::mutex> lock(s_sharedMutex);
+	s_threads = threads;
+	s_pin = pin;
+}
+
+// static
+ThreadPool& ThreadPool::shared()
+{
+	std::lock_guard<std::mutex> lock(s_sharedMutex);
+	if(!s_pShared || s_pShared->m_pid != getpid())
+	{
+		// A pool inherited through fork is leaked, because its threads
+		// only exist in the parent and cannot be joined here
+		s_pShared = new ThreadPool(s_threads, s_pin);
+	}
+	return *s_pShared;
+}
+
+void ThreadPool::work(size_t part)
+{
+	t_inJob = true; // (workers only ever run jobs)
+
+	// Pin before touching anything, so this thread's stack and scratch are
+	// allocated on its own node
+	if(m_cpus.size() > 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(m_cpus[part % m_cpus.size()], &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	uint64_t seen = 0;
+	while(true)
+	{
+		// Spin until the next job, then sleep
+		uint64_t generation = m_generation.load(std::memory_order_acquire);
+		for(size_t spins = 0; generation == seen && spins < THREADPOOL_SPINS; spins++)
+		{
+			relax();
+			generation = m_generation.load(std::memory_order_acquire);
+		}
+		if(generation == seen)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_sleeping.fetch_add(1);
+			while((generation = m_generation.load()) == seen)
+				m_wake.wait(lock);
+			m_sleeping.fetch_sub(1);
+		}
+		seen = generation;
+		if(m_stop.load())
+			return;
+		m_pJob->run(part, size());
+		m_pending.fetch_sub(1, std::memory_order_release);
+	}
+}
+
+// static
+void ThreadPool::slice(size_t count, size_t part, size_t parts, size_t& begin, size_t& end)
+{
+	size_t blocks = (count + 7) / 8;
+	begin = std::min(count, blocks * part / parts * 8);
+	end = std::min(count, blocks * (part + 1) / parts * 8);
+}
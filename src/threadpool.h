@@ -0,0 +1,107 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/// How many times an idle worker polls for a new job before it goes to sleep
+#define THREADPOOL_SPINS 20000
+
+
+/// How a ThreadPool binds its workers to CPUs
+enum PinPolicy
+{
+	PIN_NONE, // let the scheduler move workers around
+	PIN_COMPACT, // fill the CPUs of one NUMA node before moving to the next
+	PIN_SCATTER, // deal workers out to the NUMA nodes in turn
+};
+
+
+/// A persistent pool of worker threads for jobs that are too short to be
+/// worth starting threads for. Idle workers spin for a while before they
+/// sleep, so a job that follows closely on the last one starts in well under
+/// a microsecond. The calling thread always takes part 0 of a job, so a pool
+/// of n threads starts n - 1 workers. Workers can be pinned to CPUs, and
+/// memory that a pinned worker touches first is placed on its own NUMA node,
+/// so jobs should allocate their per-part scratch inside Job::run.
+class ThreadPool
+{
+public:
+	/// A job that is split into parts. Part p of n is always handed to the
+	/// same thread, so a job that splits its data the same way every time
+	/// finds each thread's slice still in that thread's cache.
+	class Job
+	{
+	public:
+		virtual ~Job() {}
+		virtual void run(size_t part, size_t parts) = 0;
+	};
+
+protected:
+	std::vector<std::thread> m_workers;
+	std::vector<int> m_cpus; // the CPU for each part, in order (empty when not pinned)
+	pid_t m_pid; // a forked child has none of our workers
+	std::mutex m_busy; // held by the thread whose job is running
+	Job* m_pJob;
+	char m_pad0[64];
+	std::atomic<uint64_t> m_generation; // bumped for each job
+	char m_pad1[64];
+	std::atomic<size_t> m_pending; // workers that have not finished the current job
+	char m_pad2[64];
+	std::atomic<size_t> m_sleeping;
+	std::atomic<bool> m_stop;
+	std::mutex m_mutex; // only used to sleep and wake
+	std::condition_variable m_wake;
+
+public:
+	/// Starts threads - 1 workers. (0 starts one thread for each CPU this
+	/// process may run on.)
+	ThreadPool(size_t threads, PinPolicy pin = PIN_NONE);
+	~ThreadPool();
+
+	/// Returns the number of parts a job is split into
+	size_t size() const { return m_workers.size() + 1; }
+
+	/// Runs every part of job, and returns when they have all finished. If
+	/// the pool is already running a job for another thread, this is a
+	/// forked child, or the calling thread is itself running part of a job
+	/// (on any pool), the parts run one after another on the calling thread.
+	void run(Job& job);
+
+	/// Like run, but returns false without running anything when the parts
+	/// could not run at the same time. (Jobs whose parts wait for each other
+	/// need this.)
+	bool tryRun(Job& job);
+
+	/// Sets the size and pinning of the shared pool. This only has an effect
+	/// until the shared pool is first used.
+	static void configure(size_t threads, PinPolicy pin);
+
+	/// Returns the process-wide pool, which is started the first time it is
+	/// needed. (A forked child gets a new one, because it has none of its
+	/// parent's threads.)
+	static ThreadPool& shared();
+
+	/// Splits count items into parts nearly equal, contiguous slices and
+	/// returns the bounds of slice part. The bounds are multiples of 8
+	/// (except at the end), so neighbouring slices of doubles do not share
+	/// cache lines.
+	static void slice(size_t count, size_t part, size_t parts, size_t& begin, size_t& end);
+
+protected:
+	void work(size_t part);
+};
+
+
+#endif // THREADPOOL_H
@@ -0,0 +1,231 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#include "trainer.h"
+#include "error.h"
+#include <algorithm>
+
+using std::vector;
+
+
+BackgroundTrainer::BackgroundTrainer(const NeuralNet& model, const TrainerOptions& options)
+: m_rand(0), m_model(m_rand), m_options(options), m_current(NULL), m_epoch(1), m_queue(options.capacity), m_accepted(0), m_finished(0), m_dropped(0), m_sleeping(false), m_stop(false)
+{
+	m_options.publish_every = std::max((size_t)1, m_options.publish_every);
+	m_options.batch_size = std::max((size_t)1, m_options.batch_size);
+	for(size_t i = 0; i < TRAINER_MAX_READERS; i++)
+		m_reader_epochs[i].store(0);
+	m_model.copy(model);
+	if(m_model.isFrozen())
+		m_model.thaw();
+	publish();
+	m_thread = std::thread(&BackgroundTrainer::run, this);
+}
+
+BackgroundTrainer::~BackgroundTrainer()
+{
+	m_stop.store(true);
+	wake();
+	m_thread.join();
+
+	// The caller guarantees that nobody is reading any more
+	delete(m_current.load());
+	for(size_t i = 0; i < m_retired.size(); i++)
+		delete(m_retired[i]);
+}
+
+bool BackgroundTrainer::enqueue(const TrainingSample& sample)
+{
+	bool accepted = true;
+	while(!m_queue.tryPush(sample))
+	{
+		if(m_options.policy == QUEUE_DROP_NEWEST)
+		{
+			accepted = false;
+			break;
+		}
+		else if(m_options.policy == QUEUE_DROP_OLDEST)
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			if(m_queue.tryPop(m_evicted))
+			{
+				m_dropped++;
+				m_finished++;
+			}
+		}
+		else
+		{
+			wake();
+			std::this_thread::yield();
+		}
+	}
+	if(!accepted)
+	{
+		m_dropped++;
+		return false;
+	}
+	m_accepted++;
+
+	// Pairs with the trainer storing m_sleeping before it checks the queue,
+	// so either it sees this pattern or we see that it is asleep
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_sleeping.load())
+		wake();
+	return true;
+}
+
+void BackgroundTrainer::wake()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	m_wake.notify_one();
+}
+
+void BackgroundTrainer::drain()
+{
+	uint64_t target = m_accepted.load();
+	std::unique_lock<std::mutex> guard(m_lock);
+	while(m_finished.load() < target)
+	{
+		m_wake.notify_one();
+		m_idle.wait(guard);
+	}
+}
+
+void BackgroundTrainer::run()
+{
+	TrainingSample sample;
+	size_t sincePublish = 0;
+	while(!m_stop.load())
+	{
+		// Train on one mini-batch
+		size_t taken = 0;
+		while(taken < m_options.batch_size && m_queue.tryPop(sample))
+		{
+			m_model.refine(sample.feature, sample.label, sample.learning_rate);
+			taken++;
+		}
+		sincePublish += taken;
+		if(sincePublish >= m_options.publish_every || (taken < m_options.batch_size && sincePublish > 0))
+		{
+			publish();
+			m_finished += sincePublish;
+			sincePublish = 0;
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_idle.notify_all();
+		}
+		if(taken == m_options.batch_size)
+			continue;
+
+		// The queue ran dry, and everything trained so far has been published
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_sleeping.store(true);
+		if(m_queue.empty() && !m_stop.load())
+			m_wake.wait(guard);
+		m_sleeping.store(false);
+	}
+}
+
+void BackgroundTrainer::publish()
+{
+	Snapshot* pSnapshot = new Snapshot(m_rand);
+	pSnapshot->nn.copy(m_model);
+	pSnapshot->nn.freeze();
+
+	// Readers that arrive after the epoch advances cannot see the old snapshot
+	Snapshot* pOld = m_current.exchange(pSnapshot);
+	if(pOld)
+	{
+		pOld->retired = m_epoch.fetch_add(1);
+		m_retired.push_back(pOld);
+	}
+	reclaim();
+}
+
+void BackgroundTrainer::reclaim()
+{
+	uint64_t oldest = m_epoch.load();
+	for(size_t i = 0; i < TRAINER_MAX_READERS; i++)
+	{
+		uint64_t e = m_reader_epochs[i].load();
+		if(e != 0 && e < oldest)
+			oldest = e;
+	}
+	size_t kept = 0;
+	for(size_t i = 0; i < m_retired.size(); i++)
+	{
+		if(m_retired[i]->retired < oldest)
+			delete(m_retired[i]);
+		else
+			m_retired[kept++] = m_retired[i];
+	}
+	m_retired.resize(kept);
+}
+
+size_t BackgroundTrainer::enter()
+{
+	// Claim a free reader slot, stamped with the current epoch
+	while(true)
+	{
+		for(size_t i = 0; i < TRAINER_MAX_READERS; i++)
+		{
+			uint64_t expected = 0;
+			if(m_reader_epochs[i].load(std::memory_order_relaxed) == 0 && m_reader_epochs[i].compare_exchange_strong(expected, m_epoch.load()))
+				return i;
+		}
+		std::this_thread::yield();
+	}
+}
+
+void BackgroundTrainer::leave(size_t slot)
+{
+	m_reader_epochs[slot].store(0, std::memory_order_release);
+}
+
+const vector<double>& BackgroundTrainer::predict(const vector<double>& in, InferenceContext& ctx)
+{
+	size_t slot = enter();
+	const vector<double>& out = m_current.load()->nn.predict(in, ctx);
+	leave(slot);
+	return out;
+}
+
+const vector<double>& BackgroundTrainer::predict(const SparseVector& in, InferenceContext& ctx)
+{
+	size_t slot = enter();
+	try
+	{
+		const vector<double>& out = m_current.load()->nn.predict(in, ctx);
+		leave(slot);
+		return out;
+	}
+	catch(...)
+	{
+		leave(slot); // (a network with a fitted normalization rejects sparse inputs)
+		throw;
+	}
+}
+
+Evaluation BackgroundTrainer::evaluate(const MatrixView& features, const MatrixView& labels)
+{
+	size_t slot = enter();
+	try
+	{
+		Evaluation result = m_current.load()->nn.evaluate(features, labels);
+		leave(slot);
+		return result;
+	}
+	catch(...)
+	{
+		leave(slot);
+		throw;
+	}
+}
+
+void BackgroundTrainer::copySnapshot(NeuralNet& nn)
+{
+	size_t slot = enter();
+	nn.copy(m_current.load()->nn);
+	leave(slot);
+}
@@ -0,0 +1,137 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+#ifndef TRAINER_H
+#define TRAINER_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "rand.h"
+#include "neuralnet.h"
+#include "queue.h"
+
+
+/// The most threads that can read from one BackgroundTrainer at the same time
+#define TRAINER_MAX_READERS 64
+
+
+/// One pattern waiting to be presented to a BackgroundTrainer
+struct TrainingSample
+{
+	std::vector<double> feature;
+	std::vector<double> label;
+	double learning_rate;
+};
+
+
+/// What BackgroundTrainer::enqueue does when its queue is full
+enum QueuePolicy
+{
+	QUEUE_BLOCK, // wait for the trainer to make room (back-pressure)
+	QUEUE_DROP_NEWEST, // drop the pattern that is being enqueued
+	QUEUE_DROP_OLDEST, // drop the oldest queued pattern to make room
+};
+
+
+/// Settings for a BackgroundTrainer
+struct TrainerOptions
+{
+	size_t publish_every; // patterns between snapshots
+	size_t capacity; // the most patterns that can wait in the queue
+	size_t batch_size; // the most patterns the trainer takes from the queue at a time
+	QueuePolicy policy;
+
+	TrainerOptions() : publish_every(256), capacity(4096), batch_size(32), policy(QUEUE_BLOCK) {}
+};
+
+
+/// Refines a private copy of a NeuralNet on a background thread, while any
+/// number of other threads make predictions with the most recently published
+/// snapshot of it. Patterns arrive through a bounded lock-free queue, so
+/// enqueueing one never takes a lock unless the trainer is asleep. Snapshots
+/// are frozen copies that are swapped in through an atomic pointer, so a
+/// prediction never waits for training and never sees a half-updated model.
+/// Old snapshots are freed with epoch-based reclamation once no reader can
+/// still be using them.
+class BackgroundTrainer
+{
+protected:
+	struct Snapshot
+	{
+		NeuralNet nn;
+		uint64_t retired; // the epoch in which it was replaced
+
+		Snapshot(Rand& r) : nn(r), retired(0) {}
+	};
+
+	Rand m_rand; // (snapshots never draw from it, but NeuralNet needs one)
+	NeuralNet m_model; // only touched by the training thread
+	TrainerOptions m_options;
+
+	std::atomic<Snapshot*> m_current;
+	std::atomic<uint64_t> m_epoch;
+	std::atomic<uint64_t> m_reader_epochs[TRAINER_MAX_READERS]; // 0 means the slot is free
+	std::vector<Snapshot*> m_retired; // only touched by the training thread
+
+	BoundedQueue<TrainingSample> m_queue;
+	std::atomic<uint64_t> m_accepted; // patterns that made it into the queue
+	std::atomic<uint64_t> m_finished; // patterns that were trained and published, or evicted
+	std::atomic<uint64_t> m_dropped;
+	std::atomic<bool> m_sleeping;
+	std::atomic<bool> m_stop;
+	std::mutex m_lock; // only used to put the trainer to sleep and wake it up
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	TrainingSample m_evicted; // (only used by QUEUE_DROP_OLDEST producers, under m_lock)
+	std::thread m_thread;
+
+public:
+	/// Starts training a copy of model. A snapshot is published after every
+	/// options.publish_every patterns, and whenever the queue runs dry.
+	BackgroundTrainer(const NeuralNet& model, const TrainerOptions& options = TrainerOptions());
+
+	/// Stops the training thread. (Patterns that are still queued are dropped.)
+	~BackgroundTrainer();
+
+	/// Queues one pattern to be presented to the private model, and returns
+	/// right away (unless the queue is full and the policy is QUEUE_BLOCK).
+	/// Returns false if this pattern was dropped.
+	bool enqueue(const TrainingSample& sample);
+
+	/// Blocks until every pattern accepted so far has been trained and published
+	void drain();
+
+	/// Returns the number of patterns that were dropped because the queue was full
+	uint64_t dropped() const { return m_dropped.load(); }
+
+	/// Predicts with the current snapshot. This never blocks on the trainer.
+	/// Each calling thread needs its own ctx.
+	const std::vector<double>& predict(const std::vector<double>& in, InferenceContext& ctx);
+	const std::vector<double>& predict(const SparseVector& in, InferenceContext& ctx);
+
+	/// Evaluates the current snapshot on a labeled data set (see NeuralNet::evaluate)
+	Evaluation evaluate(const MatrixView& features, const MatrixView& labels);
+
+	/// Copies the current snapshot into nn. (nn will be frozen.)
+	void copySnapshot(NeuralNet& nn);
+
+protected:
+	void run();
+	void wake();
+	void publish();
+	void reclaim();
+	size_t enter();
+	void leave(size_t slot);
+
+private:
+	BackgroundTrainer(const BackgroundTrainer& other);
+	BackgroundTrainer& operator=(const BackgroundTrainer& other);
+};
+
+
+#endif // TRAINER_H
@@ -0,0 +1,699 @@
+// ----------------------------------------------------------------
+// The contents of this file are distributed under the CC0 license.
+// See http://creativecommons.org/publicdomain/zero/1.0/
+// ----------------------------------------------------------------
+
+// Tests for the parts of the library that PHP cannot reach. "make test"
+// builds them without main.cpp (so PHP-CPP is not needed) and runs them.
+// The PHP API is tested by NeuralNetworkTest.php.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <math.h>
+#include <locale.h>
+#include "rand.h"
+#include "matrix.h"
+#include "neuralnet.h"
+#include "error.h"
+#include "threadpool.h"
+#include "cache.h"
+#include "fixednet.h"
+#include "string.h"
+
+using std::vector;
+
+
+static size_t s_checks = 0;
+static size_t s_failures = 0;
+
+static void check(bool ok, const char* expr, const char* file, int line)
+{
+	s_checks++;
+	if(!ok)
+	{
+		s_failures++;
+		std::cerr << file << ":" << line << ": check failed: " << expr << "\n";
+	}
+}
+
+#define CHECK(expr) check((expr), #expr, __FILE__, __LINE__)
+
+
+// Adds hidden layers of the specified widths between inputs and outputs
+static void addLayers(NeuralNet& nn, const vector<size_t>& widths)
+{
+	for(size_t i = 0; i + 1 < widths.size(); i++)
+		nn.m_layers.push_back(new Layer(widths[i], widths[i + 1]));
+	nn.init();
+}
+
+// Fills features with values from 0 to 1, and labels with a function of them
+static void makeData(Rand& r, size_t rows, Matrix& features, Matrix& labels)
+{
+	features.setSize(rows, 3);
+	labels.setSize(rows, 2);
+	for(size_t i = 0; i < rows; i++)
+	{
+		for(size_t j = 0; j < 3; j++)
+			features[i][j] = r.uniform();
+		labels[i][0] = (features[i][0] + features[i][1] + features[i][2]) / 3.0;
+		labels[i][1] = features[i][0] * features[i][1] - features[i][2];
+	}
+}
+
+static vector<double> parameters(const NeuralNet& nn)
+{
+	vector<double> values(nn.parameterCount());
+	nn.getParameters(values.data());
+	return values;
+}
+
+
+static void test_fill_normal_is_standard_normal()
+{
+	Rand r(1234);
+	vector<double> values(100001); // (odd, so the last value comes from normal())
+	r.fillNormal(values.data(), values.size());
+
+	double sum = 0.0;
+	double sumSquares = 0.0;
+	for(size_t i = 0; i < values.size(); i++)
+	{
+		sum += values[i];
+		sumSquares += values[i] * values[i];
+	}
+	double mean = sum / values.size();
+	double variance = sumSquares / values.size() - mean * mean;
+	CHECK(fabs(mean) < 0.02);
+	CHECK(fabs(variance - 1.0) < 0.02);
+}
+
+static void test_split_and_at_are_deterministic()
+{
+	Rand a(42);
+	Rand b(42);
+	a.next(); // (split must not depend on how much was drawn)
+	Rand s1 = a.split(3);
+	Rand s2 = b.split(3);
+	for(size_t i = 0; i < 100; i++)
+		CHECK(s1.next() == s2.next());
+	CHECK(Rand(42).split(0).next() == Rand(42).next());
+
+	for(uint64 i = 0; i < 100; i++)
+	{
+		CHECK(a.at(i) == b.at(i));
+		CHECK(a.split(7).at(i) == b.split(7).at(i));
+		double u = a.uniformAt(i);
+		CHECK(u >= 0.0 && u < 1.0);
+	}
+}
+
+static void test_streams_differ()
+{
+	Rand base(42);
+	Rand s1 = base.split(1);
+	Rand s2 = base.split(2);
+	size_t same = 0;
+	for(size_t i = 0; i < 100; i++)
+	{
+		if(s1.next() == s2.next())
+			same++;
+	}
+	CHECK(same == 0);
+
+	same = 0;
+	for(uint64 i = 0; i < 100; i++)
+	{
+		if(base.split(1).at(i) == base.split(2).at(i) || base.at(i) == Rand(43).at(i) || base.at(i) == base.at(i + 1))
+			same++;
+	}
+	CHECK(same == 0);
+}
+
+static void test_epoch_orders_train_the_same()
+{
+	Rand data(5);
+	Matrix features, labels;
+	makeData(data, 60, features, labels);
+
+	vector<size_t> widths = {3, 8, 2};
+	EpochOrder orders[] = {SHUFFLE_INDEXES, SHUFFLE_COPY, SHUFFLE_BLOCKS};
+	vector<double> params[3];
+	double rmse[3];
+	for(size_t i = 0; i < 3; i++)
+	{
+		Rand r(9);
+		NeuralNet nn(r);
+		addLayers(nn, widths);
+		nn.m_epoch_order = orders[i];
+		nn.m_block_rows = 16;
+		nn.train(features, labels);
+		params[i] = parameters(nn);
+		rmse[i] = nn.evaluate(features, labels).rmse;
+	}
+
+	// A copy visits the patterns in the same order, and blocks in a different one
+	CHECK(params[1] == params[0]);
+	CHECK(rmse[0] < 0.05);
+	CHECK(fabs(rmse[2] - rmse[0]) < 0.25 * rmse[0]);
+}
+
+static void test_refine_checks_vector_sizes()
+{
+	Rand r(0);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 4, 2});
+	vector<double> before = parameters(nn);
+
+	size_t thrown = 0;
+	vector<double> shortFeature = {0.1, 0.2};
+	vector<double> feature = {0.1, 0.2, 0.3};
+	vector<double> shortLabel = {0.2};
+	vector<double> label = {0.2, 0.1};
+	try { nn.refine(shortFeature, label, 0.1); } catch(const Ex&) { thrown++; }
+	try { nn.refine(feature, shortLabel, 0.1); } catch(const Ex&) { thrown++; }
+	CHECK(thrown == 2);
+	CHECK(parameters(nn) == before);
+}
+
+static void test_column_stats_match_column_methods()
+{
+	// The big matrix is split across the shared pool
+	size_t sizes[] = {200, 250000};
+	for(size_t s = 0; s < 2; s++)
+	{
+		Rand r(s);
+		Matrix m;
+		m.setSize(sizes[s], 4);
+		for(size_t i = 0; i < m.rows(); i++)
+		{
+			m[i][0] = (double)r.next(20); // (ties for the mode are likely)
+			m[i][1] = r.normal() * 3.0 + 7.0;
+			m[i][2] = r.next(10) == 0 ? UNKNOWN_VALUE : r.uniform() - 0.5;
+			m[i][3] = 2.5;
+		}
+
+		vector<ColumnStats> stats;
+		m.columnStats(stats);
+		CHECK(stats.size() == 4);
+		for(size_t j = 0; j < 4; j++)
+		{
+			size_t count = 0;
+			double sumSquares = 0.0;
+			double mean = m.columnMean(j);
+			for(size_t i = 0; i < m.rows(); i++)
+			{
+				if(m[i][j] == UNKNOWN_VALUE)
+					continue;
+				count++;
+				sumSquares += (m[i][j] - mean) * (m[i][j] - mean);
+			}
+			CHECK(stats[j].count == count);
+			CHECK(fabs(stats[j].mean - mean) <= 1e-9 * (1.0 + fabs(mean)));
+			CHECK(fabs(stats[j].variance - sumSquares / count) <= 1e-9 * (1.0 + sumSquares / count));
+			CHECK(stats[j].min == m.columnMin(j));
+			CHECK(stats[j].max == m.columnMax(j));
+			CHECK(stats[j].mode == m.mostCommonValue(j));
+		}
+
+		// Skipping the mode leaves the other statistics exactly the same
+		vector<ColumnStats> withoutMode;
+		m.columnStats(withoutMode, false);
+		for(size_t j = 0; j < 4; j++)
+		{
+			CHECK(withoutMode[j].count == stats[j].count);
+			CHECK(withoutMode[j].mean == stats[j].mean);
+			CHECK(withoutMode[j].variance == stats[j].variance);
+			CHECK(withoutMode[j].min == stats[j].min && withoutMode[j].max == stats[j].max);
+			CHECK(withoutMode[j].mode == 0.0);
+		}
+	}
+}
+
+static void test_fitted_normalization_is_applied_to_inputs()
+{
+	Rand data(3);
+	Matrix features;
+	features.setSize(500, 3);
+	for(size_t i = 0; i < features.rows(); i++)
+	{
+		features[i][0] = data.normal() * 10.0 + 100.0;
+		features[i][1] = data.uniform();
+		features[i][2] = 4.0; // (constant, so it is only shifted)
+	}
+
+	Rand r(0);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 8, 2});
+	nn.fitNormalization(features);
+
+	// Every normalized column has mean 0, and the varying ones have variance 1
+	Matrix normalized;
+	normalized.setSize(features.rows(), 3);
+	for(size_t i = 0; i < features.rows(); i++)
+		nn.normalize(features[i].data(), normalized[i].data());
+	vector<ColumnStats> stats;
+	normalized.columnStats(stats);
+	for(size_t j = 0; j < 3; j++)
+		CHECK(fabs(stats[j].mean) < 1e-9);
+	CHECK(fabs(stats[0].variance - 1.0) < 1e-9);
+	CHECK(fabs(stats[1].variance - 1.0) < 1e-9);
+	CHECK(stats[2].variance == 0.0);
+
+	// Predictions see the normalized inputs, and unknown values become the mean
+	Rand r2(0);
+	NeuralNet plain(r2);
+	plain.copy(nn);
+	plain.clearNormalization();
+	vector<double> in = {120.0, 0.25, UNKNOWN_VALUE};
+	vector<double> expected = {
+		(120.0 - nn.m_input_shift[0]) * nn.m_input_scale[0],
+		(0.25 - nn.m_input_shift[1]) * nn.m_input_scale[1],
+		0.0
+	};
+	vector<double> a = nn.forward_prop(in);
+	vector<double> b = plain.forward_prop(expected);
+	CHECK(a == b);
+
+	uint64_t version = nn.version();
+	nn.clearNormalization();
+	CHECK(nn.version() != version);
+	CHECK(nn.forward_prop(expected) == b);
+}
+
+static void test_removing_silent_units_keeps_predictions()
+{
+	Rand r(4);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 8, 2});
+
+	// Units 2 and 5 have no effect on the outputs once their outgoing weights are zero
+	Layer& next = *nn.m_layers[1];
+	for(size_t j = 0; j < next.outputs(); j++)
+	{
+		next.m_weights[j][2] = 0.0;
+		next.m_weights[j][5] = 0.0;
+	}
+	vector<double> in = {0.3, -0.2, 0.9};
+	vector<double> before = nn.forward_prop(in);
+
+	nn.removeUnits(0, {2, 5});
+	CHECK(nn.m_layers[0]->outputs() == 6);
+	CHECK(nn.m_layers[1]->inputs() == 6);
+	CHECK(nn.forward_prop(in) == before);
+}
+
+static void test_shrink_within_budget_respects_the_budget()
+{
+	Rand data(6);
+	Matrix features, labels, holdoutFeatures, holdoutLabels;
+	makeData(data, 60, features, labels);
+	makeData(data, 40, holdoutFeatures, holdoutLabels);
+
+	Rand r(8);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 16, 2});
+	nn.train(features, labels);
+
+	double budget = 0.01;
+	double before = nn.evaluate(holdoutFeatures, holdoutLabels).rmse;
+	size_t removed = nn.shrinkWithinBudget(holdoutFeatures, holdoutLabels, budget);
+	CHECK(removed > 0);
+	CHECK(nn.m_layers[0]->outputs() == 16 - removed);
+	CHECK(nn.evaluate(holdoutFeatures, holdoutLabels).rmse <= before + budget);
+}
+
+static void test_predict_matches_forward_prop()
+{
+	Rand data(2);
+	Matrix features, labels;
+	makeData(data, 20, features, labels);
+
+	Rand r(1);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 12, 7, 9, 2}); // (enough hidden layers to reuse both ping-pong buffers)
+	InferenceContext ctx(nn);
+	InferenceContext fresh; // (grows on first use)
+
+	// Plain, normalized, then pruned
+	for(size_t variant = 0; variant < 3; variant++)
+	{
+		if(variant == 1)
+			nn.fitNormalization(features);
+		if(variant == 2)
+			nn.pruneToSparsity(0.5);
+		for(size_t i = 0; i < features.rows(); i++)
+		{
+			vector<double> expected = nn.forward_prop(features[i]);
+			CHECK(nn.predict(features[i], ctx) == expected);
+			CHECK(nn.predict(features[i].data(), fresh) == expected);
+		}
+	}
+
+	// Sparse inputs
+	nn.clearNormalization();
+	SparseVector sparse;
+	sparse.add(2, 0.75);
+	sparse.add(0, -0.5);
+	vector<double> expected = nn.forward_prop(sparse);
+	CHECK(nn.predict(sparse, ctx) == expected);
+}
+
+static void test_prediction_cache_evicts_like_clock()
+{
+	// A reference CLOCK cache that finds entries by scanning
+	const size_t capacity = 8;
+	vector<double> refKeys;
+	vector<unsigned char> refBits;
+	size_t hand = 0;
+
+	PredictionCache cache;
+	cache.resize(capacity, 2, 1);
+	Rand r(11);
+	for(size_t step = 0; step < 5000; step++)
+	{
+		double in[2] = {(double)r.next(20), 0.5};
+		double out = in[0] * 3.0;
+		uint64_t version = step < 2500 ? 1 : 2;
+		if(step == 2500)
+		{
+			refKeys.clear();
+			refBits.clear();
+			hand = 0;
+		}
+
+		size_t found = refKeys.size();
+		for(size_t i = 0; i < refKeys.size(); i++)
+		{
+			if(refKeys[i] == in[0])
+				found = i;
+		}
+		const double* hit = cache.find(in, version);
+		CHECK((hit != NULL) == (found < refKeys.size()));
+		if(hit)
+		{
+			CHECK(*hit == out);
+			refBits[found] = 1;
+			continue;
+		}
+
+		cache.insert(in, &out, version);
+		if(refKeys.size() < capacity)
+		{
+			refKeys.push_back(in[0]);
+			refBits.push_back(0);
+			continue;
+		}
+		while(refBits[hand])
+		{
+			refBits[hand] = 0;
+			hand = (hand + 1) % capacity;
+		}
+		refKeys[hand] = in[0];
+		refBits[hand] = 0;
+		hand = (hand + 1) % capacity;
+	}
+	CHECK(cache.hits() + cache.misses() == 5000);
+}
+
+static void test_save_reports_write_errors()
+{
+	Rand r(0);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 64, 64, 2}); // (more than one buffer's worth of text)
+	nn.pruneToSparsity(0.5); // (so each layer is cloned to write it)
+
+	bool thrown = false;
+	try
+	{
+		nn.save("/dev/full"); // (every write fails with ENOSPC)
+	}
+	catch(const Ex&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+}
+
+// Returns the contents of a file
+static std::string readFile(const char* filename)
+{
+	std::ifstream s(filename, std::ios::binary);
+	std::ostringstream os;
+	os << s.rdbuf();
+	return os.str();
+}
+
+// Formats the data section of an ARFF file the way saveARFF did before it
+// was buffered, one cell at a time with to_str
+static std::string streamedArffData(const Matrix& m)
+{
+	std::ostringstream os;
+	for(size_t i = 0; i < m.rows(); i++)
+	{
+		for(size_t j = 0; j < m.cols(); j++)
+		{
+			if(m[i][j] == UNKNOWN_VALUE)
+				os << "?";
+			else if(m.valueCount(j) == 0)
+				os << to_str(m[i][j]);
+			else
+				os << m.attrValue(j, (size_t)m[i][j]);
+			if(j + 1 < m.cols())
+				os << ",";
+		}
+		os << "\n";
+	}
+	return os.str();
+}
+
+// Returns what saveARFF writes after the @DATA line
+static std::string savedArffData(const Matrix& m, bool parallel)
+{
+	const char* filename = "/tmp/neural-network-test.arff";
+	m.saveARFF(filename, parallel);
+	std::string s = readFile(filename);
+	remove(filename);
+	size_t pos = s.find("@DATA\n");
+	return pos == std::string::npos ? "" : s.substr(pos + 6);
+}
+
+static void test_save_arff_matches_the_stream_writer()
+{
+	const char* filename = "/tmp/neural-network-test.arff";
+	{
+		std::ofstream s(filename);
+		s << "@RELATION test\n@ATTRIBUTE a REAL\n@ATTRIBUTE color {red,green,blue}\n@ATTRIBUTE b REAL\n@ATTRIBUTE yes {no,yes}\n@DATA\n";
+	}
+	Matrix m;
+	m.loadARFF(filename);
+	remove(filename);
+
+	// Enough rows for several parallel blocks, with nominal, unknown, huge, tiny and negative-zero cells
+	Rand r(14);
+	const double specials[] = { UNKNOWN_VALUE, 0.5, -0.0, 1e20 / 3, 1e-300 / 7, 123456789012345678.0 };
+	size_t rows = ARFF_BLOCK_ROWS * 4 * 2 + 123;
+	for(size_t i = 0; i < rows; i++)
+	{
+		vector<double>& row = m.newRow();
+		row[0] = (r.uniform() - 0.5) * 1000;
+		row[1] = (double)r.next(3);
+		row[2] = specials[r.next(6)];
+		row[3] = r.next(10) == 0 ? UNKNOWN_VALUE : (double)r.next(2);
+	}
+	std::string expected = streamedArffData(m);
+	CHECK(expected.size() > 0);
+	CHECK(savedArffData(m, false) == expected);
+	CHECK(savedArffData(m, true) == expected);
+
+	// A locale with a decimal comma, which PHP's setlocale can switch to, does not change the numbers
+	const char* decimalCommas[] = { "de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", "fr_FR.utf8" };
+	for(size_t i = 0; i < sizeof(decimalCommas) / sizeof(decimalCommas[0]); i++)
+	{
+		if(!setlocale(LC_NUMERIC, decimalCommas[i]))
+			continue;
+		CHECK(savedArffData(m, false) == expected);
+		CHECK(savedArffData(m, true) == expected);
+		setlocale(LC_NUMERIC, "C");
+		break;
+	}
+}
+
+static void test_load_keeps_layers_pruned()
+{
+	Rand data(15);
+	Matrix features, labels;
+	makeData(data, 50, features, labels);
+
+	Rand r(16);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 16, 2});
+	nn.pruneToSparsity(0.5);
+	const char* filename = "/tmp/neural-network-test.nn";
+	nn.save(filename);
+
+	Rand r2(17);
+	NeuralNet copy(r2);
+	addLayers(copy, {3, 4, 2});
+	copy.load(filename);
+	remove(filename);
+	CHECK(copy.parameterCount() == nn.parameterCount());
+	for(size_t i = 0; i < copy.m_layers.size(); i++)
+		CHECK(copy.m_layers[i]->m_pruned);
+
+	// Both keep their pruned weights at zero, so they train the same
+	for(size_t i = 0; i < features.rows(); i++)
+	{
+		nn.refine(features[i], labels[i], 0.1);
+		copy.refine(features[i], labels[i], 0.1);
+	}
+	CHECK(parameters(copy) == parameters(nn));
+}
+
+static void test_load_rejects_huge_layers()
+{
+	const char* filename = "/tmp/neural-network-test.nn";
+	{
+		std::ofstream s(filename);
+		s << "NEURALNET 1\nLAYERS 2\nLAYER 1 1\n0.5 0.5\nLAYER 1 100000000000\n";
+	}
+	Rand r(18);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 4, 2});
+	bool thrown = false;
+	try
+	{
+		nn.load(filename);
+	}
+	catch(const Ex&)
+	{
+		thrown = true;
+	}
+	remove(filename);
+	CHECK(thrown);
+	CHECK(nn.m_layers.size() == 2); // (unchanged)
+}
+
+static void test_fixed_net_matches_neural_net()
+{
+	Rand data(12);
+	Matrix features, labels;
+	makeData(data, 50, features, labels);
+
+	Rand r(13);
+	NeuralNet nn(r);
+	addLayers(nn, {3, 16, 2});
+	nn.train(features, labels);
+	InferenceContext ctx(nn);
+
+	// Plain, normalized, then pruned (which FixedNet stores densely)
+	for(size_t variant = 0; variant < 3; variant++)
+	{
+		if(variant == 1)
+			nn.fitNormalization(features);
+		if(variant == 2)
+			nn.pruneToSparsity(0.5);
+		FixedNet<3, 16, 2> fixed;
+		fixed.load(nn);
+		for(size_t i = 0; i < features.rows(); i++)
+		{
+			FixedNet<3, 16, 2>::Input in = {{features[i][0], features[i][1], features[i][2]}};
+			FixedNet<3, 16, 2>::Output out = fixed.predict(in);
+			const vector<double>& expected = nn.predict(features[i], ctx);
+			CHECK(out[0] == expected[0] && out[1] == expected[1]);
+		}
+	}
+
+	// A network with a different shape is rejected
+	bool thrown = false;
+	try
+	{
+		FixedNet<3, 8, 2> wrong;
+		wrong.load(nn);
+	}
+	catch(const Ex&)
+	{
+		thrown = true;
+	}
+	CHECK(thrown);
+}
+
+// Counts the parts that ran
+struct CountJob : public ThreadPool::Job
+{
+	std::atomic<size_t> m_parts;
+
+	CountJob() : m_parts(0) {}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		m_parts.fetch_add(1);
+	}
+};
+
+// Starts an inner job from every part
+struct NestingJob : public ThreadPool::Job
+{
+	ThreadPool& m_pool;
+	std::atomic<size_t> m_inner_parts;
+	std::atomic<size_t> m_concurrent; // nested tryRun calls that claimed the pool
+
+	NestingJob(ThreadPool& pool) : m_pool(pool), m_inner_parts(0), m_concurrent(0) {}
+
+	virtual void run(size_t part, size_t parts)
+	{
+		CountJob inner;
+		if(m_pool.tryRun(inner))
+			m_concurrent.fetch_add(1);
+		m_pool.run(inner);
+		m_inner_parts.fetch_add(inner.m_parts.load());
+	}
+};
+
+static void test_nested_jobs_run_inline()
+{
+	ThreadPool pool(4);
+	for(size_t i = 0; i < 100; i++)
+	{
+		NestingJob outer(pool);
+		pool.run(outer);
+		CHECK(outer.m_concurrent.load() == 0);
+		CHECK(outer.m_inner_parts.load() == 4 * 4);
+	}
+
+	// The pool is free again afterward
+	CountJob job;
+	CHECK(pool.tryRun(job));
+	CHECK(job.m_parts.load() == 4);
+}
+
+
+int main()
+{
+	// Enough threads to take the parallel paths, even on one CPU
+	ThreadPool::configure(4, PIN_NONE);
+
+	test_fill_normal_is_standard_normal();
+	test_split_and_at_are_deterministic();
+	test_streams_differ();
+	test_epoch_orders_train_the_same();
+	test_refine_checks_vector_sizes();
+	test_column_stats_match_column_methods();
+	test_fitted_normalization_is_applied_to_inputs();
+	test_removing_silent_units_keeps_predictions();
+	test_shrink_within_budget_respects_the_budget();
+	test_predict_matches_forward_prop();
+	test_prediction_cache_evicts_like_clock();
+	test_save_reports_write_errors();
+	test_save_arff_matches_the_stream_writer();
+	test_load_keeps_layers_pruned();
+	test_load_rejects_huge_layers();
+	test_fixed_net_matches_neural_net();
+	test_nested_jobs_run_inline();
+
+	std::cout << s_checks << " checks, " << s_failures << " failures\n";
+	return s_failures == 0 ? 0 : 1;
+}
@@ -2,6 +2,7 @@
 
 use PHPUnit\Framework\TestCase;
 use jpuck\NeuralNetwork;
+use jpuck\NeuralNetworkEnsemble;
 
 class NeuralNetworkTest extends TestCase
 {
@@ -51,6 +52,604 @@ class NeuralNetworkTest extends TestCase
         $this->assertLessThan(0.05, $rmse);
     }
 
+    public function test_refine_rejects_patterns_of_the_wrong_size()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $before = $nn->predict(0.1, 0.2, 0.3);
+
+        $thrown = 0;
+        foreach ([
+            function () use ($nn) { $nn->refine([0.1, 0.2], [0.2, 0.1], 0.02); },
+            function () use ($nn) { $nn->refine([0.1, 0.2, 0.3], [0.2], 0.02); },
+            function () use ($nn) { $nn->enqueueRefine([0.1, 0.2, 0.3, 0.4], [0.2, 0.1], 0.02); },
+            function () use ($nn) { $nn->refineSparse([1 => 0.5], [0.2, 0.1, 0.0], 0.02); },
+        ] as $refine)
+        {
+            try
+            {
+                $refine();
+            }
+            catch (Exception $e)
+            {
+                $thrown++;
+            }
+        }
+
+        $this->assertSame(4, $thrown);
+        $this->assertSame($before, $nn->predict(0.1, 0.2, 0.3));
+    }
+
+    public function test_reports_stats()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $nn->refine([0.1, 0.2, 0.3], [0.2, 0.1], 0.02);
+
+        $stats = $nn->getStats();
+
+        $this->assertCount(2, $stats['layers']);
+        $this->assertGreaterThan(0, $stats['model_bytes']);
+        if ($stats['enabled'])
+        {
+            $this->assertEquals(1, $stats['samples']);
+            $this->assertGreaterThan(0, $stats['layers'][0]['flops']);
+        }
+    }
+
+    public function test_evaluate_matches_predictions()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $features = [];
+        $labels = [];
+        $sse = 0.0;
+        $sae = 0.0;
+        for ($i = 0; $i < 50; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $out = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+            $features[] = $in;
+            $labels[] = $out;
+
+            $prediction = $nn->predict(...$in);
+            for ($k = 0; $k < 2; $k++)
+            {
+                $sse += ($out[$k] - $prediction[$k]) ** 2;
+                $sae += abs($out[$k] - $prediction[$k]);
+            }
+        }
+
+        $metrics = $nn->evaluate($features, $labels);
+
+        $this->assertEquals($sse, $metrics['sse'], '', 1e-9);
+        $this->assertEquals(sqrt($sse / 100), $metrics['rmse'], '', 1e-9);
+        $this->assertEquals($sae / 100, $metrics['mae'], '', 1e-9);
+        $this->assertGreaterThanOrEqual(0.0, $metrics['accuracy']);
+        $this->assertLessThanOrEqual(1.0, $metrics['accuracy']);
+    }
+
+    public function test_evaluate_takes_the_largest_output_as_the_class()
+    {
+        $nn = new NeuralNetwork(2,8,3);
+        $features = [];
+        $labels = [];
+        for ($i = 0; $i < 10; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat()];
+            $prediction = $nn->predict(...$in);
+            $class = array_search(max($prediction), $prediction);
+
+            // The first 7 rows are labeled with the predicted class, and the rest with another one
+            $label = [0.0, 0.0, 0.0];
+            $label[$i < 7 ? $class : ($class + 1) % 3] = 1.0;
+            $features[] = $in;
+            $labels[] = $label;
+        }
+
+        $this->assertEquals(0.7, $nn->evaluate($features, $labels)['accuracy'], '', 1e-12);
+    }
+
+    public function test_evaluate_splits_a_single_output_at_the_middle_of_the_labels()
+    {
+        $nn = new NeuralNetwork(2,8,1);
+        $features = [];
+        $labels = [];
+        for ($i = 0; $i < 10; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat()];
+            $prediction = $nn->predict(...$in);
+
+            // The labels are 0 and 1, so predictions of 0.5 and up are class 1
+            $class = $prediction[0] >= 0.5 ? 1.0 : 0.0;
+            $features[] = $in;
+            $labels[] = [$i < 6 ? $class : 1.0 - $class];
+        }
+
+        $this->assertEquals(0.6, $nn->evaluate($features, $labels)['accuracy'], '', 1e-12);
+    }
+
+    public function test_evaluate_reads_the_background_snapshot()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $features = [[0.1, 0.2, 0.3], [0.4, 0.5, 0.6]];
+        $labels = [[0.2, 0.1], [0.5, -0.1]];
+        $nn->startBackgroundTraining(16);
+        $nn->refine($features[0], $labels[0], 0.02);
+        $nn->flushTraining();
+
+        $sse = 0.0;
+        foreach ($features as $i => $in)
+        {
+            $prediction = $nn->predict(...$in);
+            $sse += ($labels[$i][0] - $prediction[0]) ** 2 + ($labels[$i][1] - $prediction[1]) ** 2;
+        }
+
+        $this->assertEquals($sse, $nn->evaluate($features, $labels)['sse'], '', 1e-12);
+        $nn->stopBackgroundTraining();
+    }
+
+    public function test_sparse_input_matches_dense_input()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+
+        $this->assertEquals($nn->predict(0.0, 0.5, 0.0), $nn->predictSparse([1 => 0.5]));
+
+        $nn->refineSparse([2 => 0.25], [0.1, 0.2], 0.02);
+        $this->assertEquals($nn->predict(0.0, 0.0, 0.25), $nn->predictSparse([2 => 0.25]));
+    }
+
+    public function test_sparse_refine_rejects_a_normalized_network()
+    {
+        // A loaded model can normalize its inputs, which sparse inputs cannot express
+        $path = tempnam(sys_get_temp_dir(), 'nn');
+        (new NeuralNetwork(3,16,2))->save($path);
+        $saved = file_get_contents($path);
+        file_put_contents($path, str_replace("NORMALIZATION 0\n", "NORMALIZATION 3\n0.5 2\n0.5 2\n0.5 2\n", $saved));
+        $nn = new NeuralNetwork(3,4,2);
+        $nn->load($path);
+        unlink($path);
+
+        $this->expectException(Exception::class);
+        $nn->refineSparse([2 => 0.25], [0.1, 0.2], 0.02);
+    }
+
+    public function test_sparse_prediction_reads_the_background_snapshot()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $nn->startBackgroundTraining(16);
+        for ($i = 0; $i < 100; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $nn->refine($in, [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])], 0.02);
+        }
+        $nn->flushTraining();
+
+        $this->assertEquals($nn->predict(0.0, 0.5, 0.0), $nn->predictSparse([1 => 0.5]));
+        $nn->stopBackgroundTraining();
+    }
+
+    public function test_frozen_network_predicts_but_does_not_train()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $before = $nn->predict(0.1, 0.2, 0.3);
+
+        $nn->freeze();
+        $this->assertEquals($before, $nn->predict(0.1, 0.2, 0.3));
+
+        $this->expectException(Exception::class);
+        $nn->refine([0.1, 0.2, 0.3], [0.2, 0.1], 0.02);
+    }
+
+    public function test_background_training_matches_foreground_training()
+    {
+        $foreground = new NeuralNetwork(3,16,2);
+        $background = new NeuralNetwork(3,16,2);
+        $background->startBackgroundTraining(64);
+
+        for ($i = 0; $i < 1000; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $out = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+
+            $foreground->refine($in, $out, 0.02);
+            $background->refine($in, $out, 0.02);
+        }
+
+        $background->flushTraining();
+        $this->assertEquals($foreground->predict(0.1, 0.2, 0.3), $background->predict(0.1, 0.2, 0.3));
+
+        $background->stopBackgroundTraining();
+        $this->assertEquals($foreground->predict(0.4, 0.5, 0.6), $background->predict(0.4, 0.5, 0.6));
+    }
+
+    public function test_enqueue_refine_counts_dropped_patterns()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $nn->startBackgroundTraining(64, 8, NeuralNetwork::QUEUE_DROP_NEWEST);
+
+        $accepted = 0;
+        for ($i = 0; $i < 1000; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $out = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+
+            if ($nn->enqueueRefine($in, $out, 0.02))
+            {
+                $accepted++;
+            }
+        }
+
+        $nn->flushTraining();
+        $this->assertEquals(1000, $accepted + $nn->getStats()['dropped']);
+        $nn->stopBackgroundTraining();
+    }
+
+    public function test_prediction_cache_is_invalidated_by_refine()
+    {
+        $nn = new NeuralNetwork(3,16,2, ['prediction_cache' => 8]);
+
+        $first = $nn->predict(0.1, 0.2, 0.3);
+        $this->assertEquals($first, $nn->predict(0.1, 0.2, 0.3));
+        $this->assertEquals(1, $nn->getStats()['cache_hits']);
+
+        $nn->refine([0.1, 0.2, 0.3], [0.9, 0.1], 0.5);
+        $this->assertNotEquals($first, $nn->predict(0.1, 0.2, 0.3));
+        $this->assertEquals(2, $nn->getStats()['cache_misses']);
+    }
+
+    public function test_prune_to_sparsity_removes_the_smallest_weights()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $before = $this->layerWeights($nn);
+
+        // Three quarters of the 3x16 and 16x2 weights are removed
+        $this->assertSame(12 + 8, $nn->pruneToSparsity(0.75));
+
+        foreach ($this->layerWeights($nn) as $l => $weights)
+        {
+            $kept = array_filter($weights, function ($w) { return $w != 0.0; });
+            $this->assertCount(count($weights) / 4, $kept);
+            $smallest = min(array_map('abs', $kept));
+            foreach ($weights as $k => $w)
+            {
+                if ($w == 0.0)
+                {
+                    $this->assertLessThanOrEqual($smallest, abs($before[$l][$k]));
+                }
+                else
+                {
+                    $this->assertSame($before[$l][$k], $w);
+                }
+            }
+        }
+    }
+
+    public function test_pruned_network_predicts_like_a_dense_one_with_zeros()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $large = 0;
+        foreach ($this->layerWeights($nn) as $weights)
+        {
+            $large += count(array_filter($weights, function ($w) { return abs($w) >= 0.1; }));
+        }
+
+        $this->assertSame($large, $nn->prune(0.1));
+
+        // Pruned layers are saved with zeros for the removed weights, so a dense reader sees the same network
+        $path = tempnam(sys_get_temp_dir(), 'nn');
+        $nn->save($path);
+        $dense = new NeuralNetwork(3,4,2);
+        $dense->load($path);
+        unlink($path);
+
+        for ($i = 0; $i < 10; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $this->assertEquals($dense->predict(...$in), $nn->predict(...$in), '', 1e-12);
+        }
+    }
+
+    public function test_refine_keeps_pruned_weights_at_zero()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $nn->pruneToSparsity(0.5);
+        $pruned = $this->layerWeights($nn);
+
+        for ($i = 0; $i < 100; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $nn->refine($in, [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])], 0.1);
+        }
+
+        $refined = $this->layerWeights($nn);
+        $this->assertNotEquals($pruned, $refined);
+        foreach ($pruned as $l => $weights)
+        {
+            foreach ($weights as $k => $w)
+            {
+                if ($w == 0.0)
+                {
+                    $this->assertSame(0.0, $refined[$l][$k]);
+                }
+            }
+        }
+    }
+
+    public function test_shrink_layer_removes_hidden_units()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $nn->shrinkLayer(0, 4);
+
+        $weights = $this->layerWeights($nn);
+        $this->assertCount(3 * 4, $weights[0]);
+        $this->assertCount(4 * 2, $weights[1]);
+
+        $prediction = $nn->predict(0.1, 0.2, 0.3);
+        $this->assertCount(2, $prediction);
+        $this->assertTrue(is_finite($prediction[0]) && is_finite($prediction[1]));
+
+        $this->expectException(Exception::class);
+        $nn->shrinkLayer(1, 1);
+    }
+
+    public function test_saved_network_predicts_the_same_after_loading()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        for ($i = 0; $i < 100; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $nn->refine($in, [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])], 0.02);
+        }
+
+        $path = tempnam(sys_get_temp_dir(), 'nn');
+        $nn->save($path);
+        $copy = new NeuralNetwork(3,4,2);
+        $copy->load($path);
+        unlink($path);
+
+        $this->assertSame($nn->predict(0.1, 0.2, 0.3), $copy->predict(0.1, 0.2, 0.3));
+    }
+
+    public function test_predict_into_writes_the_same_prediction()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+
+        $out = [0.0, 0.0];
+        $nn->predictInto($out, 0.1, 0.2, 0.3);
+
+        $this->assertSame($nn->predict(0.1, 0.2, 0.3), $out);
+    }
+
+    public function test_parallel_forward_predicts_the_same()
+    {
+        $nn = new NeuralNetwork(3,64,64,2);
+        $path = tempnam(sys_get_temp_dir(), 'nn');
+        $nn->save($path);
+        $parallel = new NeuralNetwork(3,4,2);
+        $parallel->load($path);
+        unlink($path);
+        $parallel->setParallelForward(true, 0);
+
+        // phpunit.xml asks for 4 threads, so every layer is split
+        foreach ($parallel->getStats()['layers'] as $layer)
+        {
+            $this->assertSame(4, $layer['threads']);
+        }
+        $this->assertSame(1, $nn->getStats()['layers'][1]['threads']);
+
+        for ($i = 0; $i < 10; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $out = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+            $nn->refine($in, $out, 0.02);
+            $parallel->refine($in, $out, 0.02);
+        }
+
+        $this->assertSame($nn->predict(0.1, 0.2, 0.3), $parallel->predict(0.1, 0.2, 0.3));
+    }
+
+    public function test_mixed_precision_converges_like_double_precision()
+    {
+        $double = new NeuralNetwork(3,16,2);
+        $mixed = new NeuralNetwork(3,16,2);
+        $mixed->setMixedPrecision(true);
+
+        mt_srand(42);
+        $patterns = [];
+        for ($i = 0; $i < 200; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $patterns[] = [$in, [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])]];
+        }
+        for ($epoch = 0; $epoch < 20; $epoch++)
+        {
+            foreach ($patterns as $pattern)
+            {
+                $double->refine($pattern[0], $pattern[1], 0.05);
+                $mixed->refine($pattern[0], $pattern[1], 0.05);
+            }
+        }
+
+        $doubleError = 0.0;
+        $mixedError = 0.0;
+        foreach ($patterns as $pattern)
+        {
+            $d = $double->predict(...$pattern[0]);
+            $m = $mixed->predict(...$pattern[0]);
+            for ($k = 0; $k < 2; $k++)
+            {
+                $doubleError += ($d[$k] - $pattern[1][$k]) ** 2;
+                $mixedError += ($m[$k] - $pattern[1][$k]) ** 2;
+            }
+        }
+
+        $this->assertEquals(sqrt($doubleError / 400), sqrt($mixedError / 400), '', 0.005);
+    }
+
+    public function test_ensemble_matches_each_network()
+    {
+        $ensemble = new NeuralNetworkEnsemble();
+        $networks = [];
+        for ($m = 0; $m < 5; $m++)
+        {
+            $nn = new NeuralNetwork(3,16,2);
+            for ($i = 0; $i < 20; $i++)
+            {
+                $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+                $nn->refine($in, [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])], 0.1);
+            }
+            $networks[] = $nn;
+            $ensemble->add($nn);
+        }
+
+        $result = $ensemble->predict(0.1, 0.2, 0.3);
+        $mean = [0.0, 0.0];
+        foreach ($networks as $m => $nn)
+        {
+            $prediction = $nn->predict(0.1, 0.2, 0.3);
+            $this->assertSame($prediction, $result['models'][$m]);
+            $mean[0] += $prediction[0] / 5;
+            $mean[1] += $prediction[1] / 5;
+        }
+        $this->assertEquals($mean, $result['mean'], '', 1e-12);
+    }
+
+    public function test_train_processes_reduces_error()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $features = [];
+        $labels = [];
+        for ($i = 0; $i < 200; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $features[] = $in;
+            $labels[] = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+        }
+
+        $error = function () use ($nn, $features, $labels) {
+            $sse = 0.0;
+            foreach ($features as $i => $in)
+            {
+                $prediction = $nn->predict(...$in);
+                $sse += ($prediction[0] - $labels[$i][0]) ** 2 + ($prediction[1] - $labels[$i][1]) ** 2;
+            }
+            return $sse;
+        };
+
+        $before = $error();
+        $failed = $nn->trainProcesses($features, $labels, ['workers' => 2, 'epochs' => 20]);
+        $this->assertSame(0, $failed);
+        $this->assertLessThan($before, $error());
+    }
+
+    public function test_train_pipeline_reduces_error()
+    {
+        $nn = new NeuralNetwork(3,16,16,2);
+        $features = [];
+        $labels = [];
+        for ($i = 0; $i < 200; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $features[] = $in;
+            $labels[] = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+        }
+
+        $error = function () use ($nn, $features, $labels) {
+            $sse = 0.0;
+            foreach ($features as $i => $in)
+            {
+                $prediction = $nn->predict(...$in);
+                $sse += ($prediction[0] - $labels[$i][0]) ** 2 + ($prediction[1] - $labels[$i][1]) ** 2;
+            }
+            return $sse;
+        };
+
+        $before = $error();
+        $nn->trainPipeline($features, $labels, ['stages' => 3, 'epochs' => 20]);
+        $this->assertLessThan($before, $error());
+    }
+
+    public function test_train_pipeline_does_not_depend_on_the_stage_count()
+    {
+        $nn = new NeuralNetwork(3,16,16,16,2);
+        $path = tempnam(sys_get_temp_dir(), 'nn');
+        $nn->save($path);
+
+        // Both copies are built the same way, so they shuffle with the same seed
+        $one = new NeuralNetwork(3,4,2);
+        $one->load($path);
+        $three = new NeuralNetwork(3,4,2);
+        $three->load($path);
+        unlink($path);
+
+        $features = [];
+        $labels = [];
+        for ($i = 0; $i < 60; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $features[] = $in;
+            $labels[] = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+        }
+
+        $one->trainPipeline($features, $labels, ['stages' => 1, 'epochs' => 5]);
+        $three->trainPipeline($features, $labels, ['stages' => 3, 'epochs' => 5]);
+
+        $this->assertSame($this->layerWeights($one), $this->layerWeights($three));
+        $this->assertSame($one->predict(0.1, 0.2, 0.3), $three->predict(0.1, 0.2, 0.3));
+    }
+
+    public function test_search_ranks_configurations()
+    {
+        $nn = new NeuralNetwork(3,16,2);
+        $features = [];
+        $labels = [];
+        for ($i = 0; $i < 60; $i++)
+        {
+            $in = [$this->getSmallFloat(), $this->getSmallFloat(), $this->getSmallFloat()];
+            $features[] = $in;
+            $labels[] = [($in[0] + $in[1] + $in[2]) / 3.0, ($in[0] * $in[1] - $in[2])];
+        }
+
+        $table = $nn->search($features, $labels, [
+            'topologies' => [[4], [16]],
+            'learning_rates' => [0.001, 0.1],
+        ], ['folds' => 3, 'epochs' => 12, 'min_epochs' => 4]);
+
+        // After 4 epochs, the best 2 of 4 go on to train for 12
+        $this->assertCount(4, $table);
+        $this->assertSame([12, 12, 4, 4], array_column($table, 'epochs'));
+        $this->assertLessThanOrEqual($table[1]['rmse'], $table[0]['rmse']);
+    }
+
+    // Returns the weights of each layer (without the biases), read from a saved copy of $nn
+    public function layerWeights(NeuralNetwork $nn)
+    {
+        $path = tempnam(sys_get_temp_dir(), 'nn');
+        $nn->save($path);
+        $lines = file($path, FILE_IGNORE_NEW_LINES);
+        unlink($path);
+
+        $layers = [];
+        for ($i = 0; $i < count($lines); $i++)
+        {
+            $fields = explode(' ', $lines[$i]);
+            if ($fields[0] != 'LAYER')
+            {
+                continue;
+            }
+
+            // One line per output: the weights, then the bias
+            $weights = [];
+            for ($j = 1; $j <= (int) $fields[2]; $j++)
+            {
+                $row = array_map('floatval', explode(' ', $lines[$i + $j]));
+                array_pop($row);
+                $weights = array_merge($weights, $row);
+            }
+            $layers[] = $weights;
+        }
+
+        return $layers;
+    }
+
     public function getSmallFloat()
     {
         // between 0 and 1